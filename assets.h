@@ -0,0 +1,9 @@
+/* Files embedded into the binary by build.sh, see assets.c. */
+typedef struct {
+    const char *filename;
+    const char *buf; /* Null-terminated. */
+    long bufs;
+} asset_t;
+
+extern const asset_t assets[];
+extern const int nassets;
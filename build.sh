@@ -1,9 +1,34 @@
 #!/bin/bash
 
 if [ "$1" == "--debug" ]; then
-    cc='gcc -g -Wall -Wextra -std=c99 -pedantic'
+    cc='gcc -pthread -g -Wall -Wextra -std=c99 -pedantic'
 else
-    cc='gcc -O2 -Wall -Wextra -Wno-unused-parameter -Wno-unused-variable -std=c99 -pedantic'
+    cc='gcc -pthread -O2 -Wall -Wextra -Wno-unused-parameter -Wno-unused-variable -std=c99 -pedantic'
 fi
 
-$cc -o cserver main.c utils.c request.c response.c routing.c templating.c forum.c resource_cache.c
+# Embeds the pages and templates into assets.c, so the server doesn't read them from the working directory.
+embed_assets() {
+    echo '/* Generated by build.sh, do not edit. */'
+    echo '#include "assets.h"'
+    local i=0
+    for f in "$@"; do
+        echo
+        echo "static const char asset_$i[] = {"
+        od -An -v -tx1 "$f" | sed 's/ \([0-9a-f][0-9a-f]\)/0x\1,/g'
+        echo '0x00 };'
+        i=$((i + 1))
+    done
+    echo
+    echo 'const asset_t assets[] = {'
+    i=0
+    for f in "$@"; do
+        echo "    { \"$f\", asset_$i, sizeof(asset_$i) - 1 },"
+        i=$((i + 1))
+    done
+    echo '};'
+    echo "const int nassets = $i;"
+}
+
+embed_assets html/*.html templates/*.html templates/parts/*.html > assets.c
+
+$cc -o cserver main.c utils.c request.c response.c routing.c templating.c forum.c resource_cache.c poller.c uring.c timer_wheel.c multipart.c sha256.c upload_cache.c upload_index.c disk_pool.c reclaimer.c page_cache.c assets.c
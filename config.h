@@ -4,3 +4,42 @@
 #define MAX_RESP_SIZE_1 100 * 1024 * 1024
 
 #define PLACEHOLDER_IMAGE_FILENAME "placeholder.png"
+
+#define DISK_POOL_THREADS 4 /* Threads running file I/O for all event loops. */
+
+#define RECLAIM_INTERVAL_MS 1000 /* How often the reclaimer frees deleted threads and moves their files. */
+#define RECLAIM_BATCH_SIZE 64 /* Files taken out of the upload index per acquisition of its lock. */
+#define DELETED_RETENTION_SECONDS 7 * 24 * 60 * 60 /* Deleted uploads are kept this long before they're removed for good. */
+#define DELETED_PURGE_INTERVAL_SECONDS 60 * 60
+
+#define UPLOAD_CACHE_BUDGET 64 * 1024 * 1024 /* Bytes of uploaded files kept in memory, least recently used are evicted first. */
+#define UPLOAD_CACHE_MAX_FILE_SIZE 4 * 1024 * 1024 /* Larger files are always streamed from disk. */
+#define PAGE_CACHE_BUDGET 64 * 1024 * 1024 /* Bytes of rendered posts, thread pages and catalog cards kept in memory, past it they're rendered on every request. */
+
+#define LISTEN_BACKLOG 1024 /* Capped by net.core.somaxconn. Can be overridden with --backlog. */
+
+#define MAX_CONNECTIONS 65536 /* Per event loop. The connection table grows on demand up to this size. */
+
+/*
+ * Per event loop. Above either high watermark new connections are answered
+ * with a 503 and closed, until both are back at or below their low watermark.
+ */
+#define OVERLOAD_HIGH_CONNECTIONS 60000
+#define OVERLOAD_LOW_CONNECTIONS 50000
+#define OVERLOAD_HIGH_QUEUED_BYTES 256 * 1024 * 1024 /* Bytes of responses that haven't finished sending. */
+#define OVERLOAD_LOW_QUEUED_BYTES 128 * 1024 * 1024
+#define OVERLOAD_RETRY_AFTER_SECONDS 5
+
+#define MAX_REQUESTS_PER_CONNECTION 1000
+
+/* Connections are closed when a state takes longer than this, measured from when the state was entered. */
+#define HEADER_TIMEOUT_MS 10000 /* From the first byte of a request until its headers are complete. */
+#define BODY_TIMEOUT_MS 120000 /* Whole request body. */
+#define SEND_TIMEOUT_MS 120000 /* Whole response. */
+#define KEEPALIVE_TIMEOUT_MS 5000 /* Persistent connection waiting for its next request. */
+
+#define DEFAULT_POLLER_BACKEND "epoll" /* "poll", "epoll" or "uring", can be overridden with --poller. */
+#define URING_ENTRIES 4096
+#define DEFAULT_WORKERS 1 /* Event loop threads, 0 means one per online CPU. Can be overridden with --workers. */
+#define MAX_WORKERS 256
+#define DEFAULT_ASSETS "embedded" /* "embedded" or "disk", can be overridden with --assets. With "disk", pages and templates are read from the working directory and reloaded when they change. */
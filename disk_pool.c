@@ -0,0 +1,146 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "disk_pool.h"
+
+/*
+ * Threads that run jobs which may block on the disk, so that a slow disk
+ * doesn't stall the event loops. Every loop has its own queue of finished
+ * jobs with an eventfd that becomes readable when jobs were added to it, the
+ * loop polls the eventfd together with its sockets.
+ *
+ * Jobs are usually embedded at the start of a larger struct holding what the
+ * job works on, the pool only links them into its lists.
+ */
+struct disk_queue {
+    int fd; /* eventfd */
+    pthread_mutex_t lock;
+    disk_job_t *head; /* Most recently finished first. */
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static disk_job_t *pending_head;
+static disk_job_t *pending_tail;
+
+static void
+job_done(disk_job_t *job)
+{
+    disk_queue_t *q = job->done;
+    pthread_mutex_lock(&q->lock);
+    job->next = q->head;
+    q->head = job;
+    pthread_mutex_unlock(&q->lock);
+
+    uint64_t one = 1;
+    if (write(q->fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("job_done: write()");
+        exit(1);
+    }
+}
+
+static void *
+pool_thread_main(void *arg)
+{
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (!pending_head) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        disk_job_t *job = pending_head;
+        pending_head = job->next;
+        if (!pending_head) {
+            pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        job->fun(job);
+        job_done(job);
+    }
+    return arg;
+}
+
+void
+disk_pool_start(int nthreads)
+{
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_thread_main, NULL) != 0) {
+            fprintf(stderr, "disk_pool_start: pthread_create() failed.\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+/* Runs job on the pool, it is returned by disk_queue_take() on q when done. */
+void
+disk_pool_submit(disk_queue_t *q, disk_job_t *job, long token)
+{
+    job->token = token;
+    job->done = q;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pending_tail) {
+        pending_tail->next = job;
+    } else {
+        pending_head = job;
+    }
+    pending_tail = job;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+disk_queue_t *
+disk_queue_create(void)
+{
+    disk_queue_t *q = calloc(1, sizeof(disk_queue_t));
+    if (!q) {
+        fprintf(stderr, "disk_queue_create: calloc() failed.\n");
+        exit(1);
+    }
+    q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->fd < 0) {
+        perror("disk_queue_create: eventfd()");
+        exit(1);
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    return q;
+}
+
+int
+disk_queue_fd(disk_queue_t *q)
+{
+    return q->fd;
+}
+
+/* Called when the queue's fd is readable. Returns the finished jobs as a list in the order they finished. */
+disk_job_t *
+disk_queue_take(disk_queue_t *q)
+{
+    uint64_t count;
+    if (read(q->fd, &count, sizeof(count)) < 0) {
+        /* Nothing was added since the last call. */
+        return NULL;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    disk_job_t *job = q->head;
+    q->head = NULL;
+    pthread_mutex_unlock(&q->lock);
+
+    disk_job_t *ordered = NULL;
+    while (job) {
+        disk_job_t *next = job->next;
+        job->next = ordered;
+        ordered = job;
+        job = next;
+    }
+    return ordered;
+}
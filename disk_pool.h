@@ -0,0 +1,15 @@
+typedef struct disk_job {
+    void (*fun)(struct disk_job *job); /* Runs on a pool thread. */
+    long token; /* Identifies the job to the loop that submitted it. */
+    struct disk_queue *done;
+    struct disk_job *next;
+} disk_job_t;
+
+typedef struct disk_queue disk_queue_t;
+
+void disk_pool_start(int nthreads);
+void disk_pool_submit(disk_queue_t *q, disk_job_t *job, long token);
+
+disk_queue_t *disk_queue_create(void);
+int disk_queue_fd(disk_queue_t *q);
+disk_job_t *disk_queue_take(disk_queue_t *q);
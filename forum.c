@@ -3,10 +3,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "utils.h"
 #include "forum.h"
+#include "upload_index.h"
+#include "page_cache.h"
 
 #define MAX_THREADS 1000
 #define THREAD_BUMP_LIMIT 200
@@ -20,6 +23,52 @@ static long threads_allocated = 0;
 
 static long next_post_id = 2137;
 
+/*
+ * Workers render pages concurrently under the read lock, anything that
+ * modifies the store takes the write lock.
+ */
+static pthread_rwlock_t forum_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Posts of deleted threads, freed by forum_reclaim() so that deleting a thread under the write lock stays cheap. */
+typedef struct pruned_thread {
+    post_t *posts;
+    long nposts;
+    struct pruned_thread *next;
+} pruned_thread_t;
+
+static pruned_thread_t *pruned = NULL;
+static pthread_mutex_t pruned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+forum_read_lock(void)
+{
+    if (pthread_rwlock_rdlock(&forum_lock) != 0) {
+        fprintf(stderr, "forum_read_lock: pthread_rwlock_rdlock() failed.\n");
+        exit(1);
+    }
+}
+
+void
+forum_read_unlock(void)
+{
+    pthread_rwlock_unlock(&forum_lock);
+}
+
+static void
+forum_write_lock(void)
+{
+    if (pthread_rwlock_wrlock(&forum_lock) != 0) {
+        fprintf(stderr, "forum_write_lock: pthread_rwlock_wrlock() failed.\n");
+        exit(1);
+    }
+}
+
+static void
+forum_write_unlock(void)
+{
+    pthread_rwlock_unlock(&forum_lock);
+}
+
 static long
 get_next_post_id(void)
 {
@@ -30,9 +79,10 @@ static void
 get_timestamp_string(char *buf, int bufsize)
 {
     time_t t = time(NULL);
-    struct tm *timeptr = localtime(&t);
+    struct tm tm;
+    struct tm *timeptr = localtime_r(&t, &tm);
     if (!timeptr) {
-        fprintf(stderr, "get_timestamp_string: localtime() failed.\n");
+        fprintf(stderr, "get_timestamp_string: localtime_r() failed.\n");
         exit(1);
     }
     snprintf(buf, bufsize, "%04d-%02d-%02d %02d:%02d:%02d", timeptr->tm_year + 1900, timeptr->tm_mon + 1,
@@ -64,25 +114,23 @@ validate_post(post_t *post, int post_is_op, const char *subject)
     return 0;
 }
 
-int
-posts_get_by_thread_id(long thread_id, post_t **posts, long *nposts)
+/*
+ * Returns NULL if there's no such thread. The caller must hold the forum read
+ * lock for as long as it uses the thread and its posts, including the cache
+ * slots of its card and post fragments.
+ */
+thread_t *
+thread_get_by_id(long thread_id)
 {
-    thread_t *thread = NULL;
     for (long i = 0; i < nthreads; i++) {
         if (threads[i].thread_id == thread_id) {
-            thread = &threads[i];
-            break;
+            return &threads[i];
         }
     }
-    if (!thread) {
-        fprintf(stderr, "posts_get_by_thread_id: Thread not found.\n");
-        return 1;
-    }
-    *posts = thread->posts;
-    *nposts = thread->nposts;
-    return 0;
+    return NULL;
 }
 
+static int post_create_locked(long thread_id, post_t *post);
 static post_t *post_get_by_id(long post_id);
 static void post_fields_delete(post_t *post);
 static void post_set_hidden_by_id(long post_id);
@@ -103,37 +151,21 @@ post_get_by_id(long post_id)
     return NULL;
 }
 
+/* Drops the post's reference to its file, which stops being served right away. The file is moved later by the reclaimer. */
 static void
-post_fields_delete(post_t *post)
+post_release_file(post_t *post)
 {
-    free(post->comment);
-
     if (*post->filename && strcmp(post->filename, PLACEHOLDER_IMAGE_FILENAME) != 0) {
-        const char olddir[] = "uploads/";
-        const char newdir[] = "uploads/deleted/";
-
-        int fnlen = strlen(post->filename);
-
-        if (sizeof(newdir) + fnlen > 256) {
-            fprintf(stderr, "post_fields_delete: Buffer too small.\n");
-            exit(1);
-        }
-        
-        char oldpath[256];
-        memcpy(oldpath, olddir, sizeof(olddir) - 1);
-        memcpy(&oldpath[sizeof(olddir) - 1], post->filename, fnlen + 1);
-
-        char newpath[256];
-        memcpy(newpath, newdir, sizeof(newdir) - 1);
-        memcpy(&newpath[sizeof(newdir) - 1], post->filename, fnlen + 1);
-
-        int ret = rename(oldpath, newpath);
-        if (ret != 0) {
-            perror("post_fields_delete: rename()");
-        }
+        upload_index_unref(post->filename);
     }
 }
 
+static void
+post_fields_delete(post_t *post)
+{
+    free(post->comment);
+}
+
 static void
 post_set_hidden_by_id(long post_id)
 {
@@ -143,10 +175,12 @@ post_set_hidden_by_id(long post_id)
         return;
     }
     post->hidden = 1;
+    page_cache_invalidate(&post->fragment);
+    page_cache_invalidate(&thread_get_by_id(post->thread_id)->page);
 }
 
-int
-post_create(long thread_id, post_t *p)
+static int
+post_create_locked(long thread_id, post_t *p)
 {
     thread_t *thread = NULL;
     int thread_is_first = 0;
@@ -159,7 +193,7 @@ post_create(long thread_id, post_t *p)
         }
     }
     if (!thread) {
-        fprintf(stderr, "post_create: Thread not found.\n");
+        fprintf(stderr, "post_create_locked: Thread not found.\n");
         return 1;
     }
 
@@ -168,7 +202,7 @@ post_create(long thread_id, post_t *p)
     if (!post_is_op) {
         int ret = validate_post(p, 0, NULL);
         if (ret != 0) {
-            fprintf(stderr, "post_create: Failed to validate post.\n");
+            fprintf(stderr, "post_create_locked: Failed to validate post.\n");
             return 1;
         }
     }
@@ -176,7 +210,7 @@ post_create(long thread_id, post_t *p)
     if (thread->nposts + 1 > thread->posts_allocated) {
         post_t *tmp = realloc(thread->posts, (thread->posts_allocated + POST_CACHE_RESIZE_INC) * sizeof(post_t));
         if (!tmp) {
-            fprintf(stderr, "post_create: realloc() failed.\n");
+            fprintf(stderr, "post_create_locked: realloc() failed.\n");
             exit(1);
         }
         memset(&tmp[thread->posts_allocated], 0, POST_CACHE_RESIZE_INC * sizeof(post_t));
@@ -222,6 +256,13 @@ post_create(long thread_id, post_t *p)
 
     /* timestamp */
     get_timestamp_string(post->timestamp, POST_TIMESTAMP_MAXLEN);
+
+    post->name_len = strlen(post->name);
+    post->timestamp_len = strlen(post->timestamp);
+    post->filename_len = strlen(post->filename);
+    post->comment_len = strlen(post->comment);
+
+    page_cache_invalidate(&thread->page);
     
     // TODO: Move thread to front.
     if (!thread->no_bump) {
@@ -231,14 +272,37 @@ post_create(long thread_id, post_t *p)
     return 0;
 }
 
+int
+post_create(long thread_id, post_t *p)
+{
+    forum_write_lock();
+    int ret = post_create_locked(thread_id, p);
+    forum_write_unlock();
+    return ret;
+}
+
 static void
 thread_delete_by_pos(long pos)
 {
     thread_t *thread = &threads[pos];
     for (long i = 0; i < thread->nposts; i++) {
-        post_fields_delete(&thread->posts[i]);
+        post_release_file(&thread->posts[i]);
+        page_cache_invalidate(&thread->posts[i].fragment);
     }
-    free(thread->posts);
+    page_cache_invalidate(&thread->card);
+    page_cache_invalidate(&thread->page);
+
+    pruned_thread_t *pt = malloc(sizeof(pruned_thread_t));
+    if (!pt) {
+        fprintf(stderr, "thread_delete_by_pos: malloc() failed.\n");
+        exit(1);
+    }
+    pt->posts = thread->posts;
+    pt->nposts = thread->nposts;
+    pthread_mutex_lock(&pruned_lock);
+    pt->next = pruned;
+    pruned = pt;
+    pthread_mutex_unlock(&pruned_lock);
 
     if (nthreads > pos + 1) {
         memmove(&threads[pos], &threads[pos + 1], (nthreads - pos - 1) * sizeof(thread_t));
@@ -249,14 +313,33 @@ thread_delete_by_pos(long pos)
 void
 delete_post_or_thread(long post_id)
 {
+    forum_write_lock();
     for (long i = 0; i < nthreads; i++) {
         if (threads[i].thread_id == post_id) {
             thread_delete_by_pos(i);
+            forum_write_unlock();
             return;
         }
     }
 
     post_set_hidden_by_id(post_id);
+    forum_write_unlock();
+}
+
+/* Called when the templates change, every post, card and thread page has to be rendered again. */
+void
+forum_invalidate_page_caches(void)
+{
+    forum_write_lock();
+    for (long i = 0; i < nthreads; i++) {
+        thread_t *thread = &threads[i];
+        for (long j = 0; j < thread->nposts; j++) {
+            page_cache_invalidate(&thread->posts[j].fragment);
+        }
+        page_cache_invalidate(&thread->card);
+        page_cache_invalidate(&thread->page);
+    }
+    forum_write_unlock();
 }
 
 int
@@ -268,6 +351,8 @@ thread_create(post_t *p, const char *subject)
         return 1;
     }
 
+    forum_write_lock();
+
     if (nthreads + 1 > threads_allocated) {
         thread_t *tmp = realloc(threads, (threads_allocated + THREAD_CACHE_RESIZE_INC) * sizeof(thread_t));
         if (!tmp) {
@@ -284,18 +369,48 @@ thread_create(post_t *p, const char *subject)
     long id = get_next_post_id();
     thread->thread_id = id;
     memcpy(&thread->subject, subject, THREAD_SUBJECT_MAXLEN);
-    if (post_create(id, p) != 0) {
-        fprintf(stderr, "thread_create: post_create() failed. (how?)\n");
+    thread->subject_len = strlen(thread->subject);
+    if (post_create_locked(id, p) != 0) {
+        fprintf(stderr, "thread_create: post_create_locked() failed. (how?)\n");
         exit(1);
     }
 
     if (nthreads > MAX_THREADS) {
         thread_delete_by_pos(nthreads - 1);
     }
+    forum_write_unlock();
 
     return 0;
 }
 
+/*
+ * Frees the posts of threads deleted since the last call. Readers only use
+ * posts while holding the read lock, so nothing refers to them once they're
+ * off the list. Returns the number of threads freed.
+ */
+long
+forum_reclaim(void)
+{
+    pthread_mutex_lock(&pruned_lock);
+    pruned_thread_t *pt = pruned;
+    pruned = NULL;
+    pthread_mutex_unlock(&pruned_lock);
+
+    long n = 0;
+    while (pt) {
+        pruned_thread_t *next = pt->next;
+        for (long i = 0; i < pt->nposts; i++) {
+            post_fields_delete(&pt->posts[i]);
+        }
+        free(pt->posts);
+        free(pt);
+        pt = next;
+        n++;
+    }
+    return n;
+}
+
+/* The caller must hold the forum read lock for as long as it uses the returned threads. */
 void
 threads_get(thread_t **t, long *nt)
 {
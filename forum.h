@@ -13,24 +13,39 @@ typedef struct {
     char filename[POST_FILENAME_MAXLEN];
     char *comment;
     int hidden;
+
+    /* Lengths of the strings above, set when the post is created. */
+    int name_len;
+    int timestamp_len;
+    int filename_len;
+    long comment_len;
+
+    struct page_cache_entry *fragment; /* Rendered post, NULL until it's first shown. */
 } post_t;
 
 typedef struct {
     long thread_id;
     char subject[THREAD_SUBJECT_MAXLEN];
+    int subject_len;
     post_t *posts;
     long nposts;
     long posts_allocated;
     int no_bump;
-    int valid_page_cache;
+    struct page_cache_entry *card; /* Rendered catalog entry of the thread, only depends on the OP. */
+    struct page_cache_entry *page; /* Rendered thread page, assembled from the fragments of its posts. NULL until it's first shown. */
 } thread_t;
 
-int posts_get_by_thread_id(long thread_id, post_t **posts, long *nposts);
+void forum_read_lock(void);
+void forum_read_unlock(void);
+
+thread_t *thread_get_by_id(long thread_id);
 void threads_get(thread_t **threads, long *nthreads);
 
 int post_create(long thread_id, post_t *post);
 int thread_create(post_t *post, const char *subject);
 
 void delete_post_or_thread(long post_id);
+void forum_invalidate_page_caches(void);
 
 void forum_init(void);
+long forum_reclaim(void);
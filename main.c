@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,9 +10,11 @@
 #include <netdb.h>
 #include <time.h>
 #include <signal.h>
-#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include "utils.h"
 #include "response.h"
@@ -21,16 +23,38 @@
 #include "request.h"
 #include "config.h"
 #include "routing.h"
+#include "poller.h"
+#include "uring.h"
+#include "timer_wheel.h"
+#include "multipart.h"
+#include "upload_index.h"
+#include "disk_pool.h"
+#include "reclaimer.h"
+#include "resource_cache.h"
 
-#define CONNECTION_SLOTS_COUNT 100
+#define CONNECTION_TABLE_INITIAL_SIZE 64
 #define REQUEST_BUFFER_SIZE 1024 * 8
+#define BODY_CHUNK_SIZE 1024 * 64
 #define RESPONSE_HEADERS_BUFFER_SIZE 1024 * 8 /* When writing response headers no buffer size checks are performed so don't set this too low. */
+#define POLLER_MAX_EVENTS 256
+#define LISTENER_TOKEN -1
+#define CANCEL_TOKEN -2
+#define DISK_TOKEN -3
+#define WATCH_TOKEN -4
 
 enum connection_state {
     CON_CLOSED,
     CON_RECEIVING_HEADERS,
     CON_RECEIVING_BODY,
     CON_SENDING_RESPONSE,
+    CON_WAITING_DISK, /* A request job is running on the disk pool. The connection gets no events and has no deadline meanwhile. */
+};
+
+enum uring_op {
+    URING_OP_NONE,
+    URING_OP_RECV,
+    URING_OP_WRITEV,
+    URING_OP_POLL, /* Waiting for readiness before retrying the operation the state calls for. */
 };
 
 typedef struct {
@@ -39,281 +63,948 @@ typedef struct {
     int headers_end_state;
     char *buf;
     long bufpos;
+    char *body_chunk; /* Receives the request body, which is parsed as it arrives. Only allocated while receiving a body. */
+    long body_chunk_pos; /* Bytes in body_chunk that weren't handed to the disk pool yet. */
+    long body_deadline; /* When the whole body must have arrived, it isn't extended by time spent on the disk pool. */
+    long req_end; /* Offset in buf just past the current request, bytes after it belong to pipelined requests. */
     request_t req;
     handler_t h;
+    long next_free; /* Index of the next free slot while this one is on the free list, -1 terminates the list. */
+    long nrequests; /* Requests completed on this connection. */
+    long resp_bytes; /* Size of the response being sent, counted in the loop's queued_bytes until it's done. */
+    int idle; /* Waiting for the next request of a persistent connection, the header timeout starts with its first byte. */
+    enum uring_op op; /* io_uring engine: the single operation in flight for this connection. */
+    int closing; /* io_uring engine: closed while an operation was in flight, slot is released when it completes. */
+    struct iovec *iov; /* io_uring engine: kept out of the table so it doesn't move when the table grows. */
 } connection_t;
 
+typedef struct {
+    enum poller_backend poller_backend;
+    int use_uring;
+    int assets_from_disk;
+    int workers;
+    int backlog;
+} options_t;
+
+typedef struct {
+    int listening_socket;
+    poller_t *poller; /* Exactly one of poller and uring is set. */
+    uring_t *uring;
+    connection_t *cons;
+    long cons_allocated;
+    long free_head;
+    int active_connections;
+    long queued_bytes; /* Bytes of responses that haven't finished sending. */
+    int overloaded; /* New connections are answered with overload_resp and closed. */
+    char overload_resp[RESPONSE_OVERLOAD_MAX_SIZE];
+    long overload_resp_len;
+    int spare_fd; /* Reserved descriptor, released to shed connections when the process runs out of fds. */
+    timer_wheel_t *timers; /* Deadline of the current state of every connection, keyed by slot. */
+    long now; /* Monotonic ms, updated once per loop iteration. */
+    disk_queue_t *disk; /* Finished request jobs of this loop's connections. */
+    int watch_fd; /* Changes to cached templates and pages, watched by a single loop. -1 in the others. */
+} loop_t;
+
+/*
+ * Request body parsing and routing that may block on the disk, run on the
+ * disk pool. The job works on copies of the connection's request and handler,
+ * since the connection table may move meanwhile, and they are copied back when
+ * it's done. The data they point to is in the connection's own buffers, which
+ * stay put.
+ */
+typedef struct {
+    disk_job_t job;
+    request_t req;
+    handler_t h;
+    const char *data; /* Next part of the body to parse. */
+    long len;
+    int routed; /* The handler was set up, otherwise more of the body is needed. */
+} request_job_t;
+
+static long
+connection_token(loop_t *loop, connection_t *con)
+{
+    return con - loop->cons;
+}
+
+/* With io_uring the operation for the new state is submitted by connection_arm_uring() instead. */
 static void
-close_connection(connection_t *con, struct pollfd *poll_data, int poll_index, int *active_connections, int *active_slot_with_highest_index)
-{
-    struct pollfd *poll_slot = &poll_data[poll_index];
-    poll_slot->fd = -1;
-    poll_slot->events = 0;
-    (*active_connections)--;
-    if (poll_index == *active_slot_with_highest_index) {
-        for (int i = poll_index; i >= 0; i--) {
-            if (poll_data[i].fd > 0) {
-                *active_slot_with_highest_index = i;
-                break;
-            }
+connection_set_events(loop_t *loop, connection_t *con, unsigned int events)
+{
+    if (loop->poller) {
+        poller_mod(loop->poller, con->sock, events, connection_token(loop, con));
+    }
+}
+
+/* The connection is closed if it is still in its current state timeout_ms from now. */
+static void
+connection_set_deadline(loop_t *loop, connection_t *con, long timeout_ms)
+{
+    timer_wheel_schedule(loop->timers, connection_token(loop, con), loop->now + timeout_ms);
+}
+
+static void
+end_request_body(connection_t *con)
+{
+    multipart_free(con->req.form);
+    con->req.form = NULL;
+    free(con->body_chunk);
+    con->body_chunk = NULL;
+}
+
+static void
+close_connection(loop_t *loop, connection_t *con)
+{
+    timer_wheel_cancel(loop->timers, connection_token(loop, con));
+    if (con->op != URING_OP_NONE) {
+        /* The kernel may still be using the connection's buffers, finish closing when the operation completes. */
+        if (!con->closing) {
+            con->closing = 1;
+            shutdown(con->sock, SHUT_RDWR);
+            uring_prep_cancel(loop->uring, connection_token(loop, con), CANCEL_TOKEN);
+        }
+        return;
+    }
+    if (con->state == CON_RECEIVING_BODY) {
+        end_request_body(con);
+    } else if (con->state == CON_SENDING_RESPONSE) {
+        loop->queued_bytes -= con->resp_bytes;
+        if (con->h.handler_after) {
+            con->h.handler_after(&con->h.args);
         }
     }
 
+    if (loop->poller) {
+        poller_del(loop->poller, con->sock);
+    }
     close(con->sock);
+    loop->active_connections--;
 
-    memset(con->buf, 0, REQUEST_BUFFER_SIZE);
+    memset(con->buf, 0, con->bufpos);
     char *tmp_conbuf = con->buf;
 
-    memset(con->h.resp_headers_buf, 0, RESPONSE_HEADERS_BUFFER_SIZE);
     char *tmp_respbuf = con->h.resp_headers_buf;
+    struct iovec *tmp_iov = con->iov;
 
     memset(con, 0, sizeof(connection_t));
     con->buf = tmp_conbuf;
     con->h.resp_headers_buf = tmp_respbuf;
+    con->iov = tmp_iov;
     con->state = CON_CLOSED;
+
+    /* LIFO, so recently used slots that already have buffers are handed out first. */
+    con->next_free = loop->free_head;
+    loop->free_head = connection_token(loop, con);
 }
 
+/*
+ * Prepares a persistent connection for its next request without closing the socket.
+ * Bytes received past the end of the finished request are moved to the start of the buffer.
+ */
 static void
-free_body_buffer(const char *req_buf, char *body_buf)
+reset_connection(loop_t *loop, connection_t *con)
 {
-    if (body_buf < req_buf || body_buf > &req_buf[REQUEST_BUFFER_SIZE - 1]) {
-        free(body_buf);
+    con->h.handler_after(&con->h.args);
+    loop->queued_bytes -= con->resp_bytes;
+    con->resp_bytes = 0;
+
+    long leftover = con->bufpos - con->req_end;
+    if (leftover > 0) {
+        memmove(con->buf, &con->buf[con->req_end], leftover);
+    } else {
+        leftover = 0;
+    }
+    memset(&con->buf[leftover], 0, con->bufpos - leftover);
+    con->bufpos = leftover;
+    con->req_end = 0;
+    con->headers_end_state = 0;
+    memset(&con->req, 0, sizeof(request_t));
+
+    char *tmp_respbuf = con->h.resp_headers_buf;
+    memset(&con->h, 0, sizeof(handler_t));
+    con->h.resp_headers_buf = tmp_respbuf;
+
+    con->nrequests++;
+    con->state = CON_RECEIVING_HEADERS;
+    connection_set_events(loop, con, POLLER_IN);
+    if (con->bufpos == 0) {
+        con->idle = 1;
+        connection_set_deadline(loop, con, KEEPALIVE_TIMEOUT_MS);
+    } else {
+        connection_set_deadline(loop, con, HEADER_TIMEOUT_MS);
     }
 }
 
+/*
+ * Closes connections whose deadline passed: clients that are too slow to send
+ * a request or to read a response, and persistent connections that were idle
+ * for too long. Returns the poll timeout until the next deadline.
+ */
 static int
-accept_connection(int listening_socket)
+expire_connections(loop_t *loop)
 {
-    int sock = accept(listening_socket, NULL, NULL);
-    if (sock <= 0) {
-        perror("accept");
-        exit(1);
+    loop->now = get_monotonic_ms();
+    timer_wheel_advance(loop->timers, loop->now);
+    long token;
+    while (timer_wheel_next_expired(loop->timers, &token)) {
+        close_connection(loop, &loop->cons[token]);
     }
+    return timer_wheel_timeout(loop->timers, loop->now);
+}
 
-    if (fcntl(sock, F_SETFL, O_NONBLOCK | fcntl(sock, F_GETFL, 0)) != 0) {
-        perror("fcntl");
-        exit(1);
+/*
+ * Doubles the connection table and puts the new slots on the free list.
+ * Connections are referred to by index everywhere outside of a single event
+ * handler, so moving the table is safe.
+ */
+static int
+grow_connection_table(loop_t *loop)
+{
+    long oldsize = loop->cons_allocated;
+    long newsize = (oldsize > 0) ? oldsize * 2 : CONNECTION_TABLE_INITIAL_SIZE;
+    if (newsize > MAX_CONNECTIONS) {
+        newsize = MAX_CONNECTIONS;
+    }
+    if (newsize <= oldsize) {
+        return 1;
     }
 
-    return sock;
+    connection_t *tmp = realloc(loop->cons, newsize * sizeof(connection_t));
+    if (!tmp) {
+        fprintf(stderr, "grow_connection_table: realloc() failed.\n");
+        return 1;
+    }
+    memset(&tmp[oldsize], 0, (newsize - oldsize) * sizeof(connection_t));
+    for (long i = newsize - 1; i >= oldsize; i--) {
+        tmp[i].state = CON_CLOSED;
+        tmp[i].next_free = loop->free_head;
+        loop->free_head = i;
+    }
+    loop->cons = tmp;
+    loop->cons_allocated = newsize;
+    timer_wheel_reserve(loop->timers, newsize);
+    return 0;
 }
 
-static void
-handle_connections(int listening_socket)
+/* Returns NULL when the table is at MAX_CONNECTIONS or memory ran out. */
+static connection_t *
+alloc_connection(loop_t *loop)
 {
-    connection_t cons[CONNECTION_SLOTS_COUNT] = {0};
-    struct pollfd poll_data[CONNECTION_SLOTS_COUNT + 1] = {0};
-    int active_connections = 0;
+    if (loop->free_head < 0 && grow_connection_table(loop) != 0) {
+        return NULL;
+    }
 
-    for (int i = 0; i < CONNECTION_SLOTS_COUNT; i++) {
-        cons[i].state = CON_CLOSED;
-        cons[i].buf = calloc(REQUEST_BUFFER_SIZE, 1);
-        if (!cons[i].buf) {
-            fprintf(stderr, "handle_connections: calloc() failed.\n");
-            exit(1);
+    connection_t *con = &loop->cons[loop->free_head];
+
+    /* Buffers are allocated on first use of a slot and kept for its reuse. */
+    if (!con->buf) {
+        con->buf = calloc(REQUEST_BUFFER_SIZE, 1);
+        if (!con->buf) {
+            fprintf(stderr, "alloc_connection: calloc() failed.\n");
+            return NULL;
         }
-        cons[i].h.resp_headers_buf = calloc(RESPONSE_HEADERS_BUFFER_SIZE, 1);
-        if (!cons[i].h.resp_headers_buf) {
-            fprintf(stderr, "handle_connections: calloc() failed.\n");
-            exit(1);
+    }
+    if (!con->h.resp_headers_buf) {
+        con->h.resp_headers_buf = malloc(RESPONSE_HEADERS_BUFFER_SIZE);
+        if (!con->h.resp_headers_buf) {
+            fprintf(stderr, "alloc_connection: malloc() failed.\n");
+            return NULL;
         }
     }
+    if (loop->uring && !con->iov) {
+        con->iov = malloc(HANDLER_MAX_IOV * sizeof(struct iovec));
+        if (!con->iov) {
+            fprintf(stderr, "alloc_connection: malloc() failed.\n");
+            return NULL;
+        }
+    }
+
+    loop->free_head = con->next_free;
+    con->next_free = -1;
+    return con;
+}
+
+/* How much of the body to read into body_chunk next, never past the end of the request. */
+static long
+body_chunk_len(connection_t *con)
+{
+    long remaining = con->req.content_length - con->req.body_bufpos - con->body_chunk_pos;
+    long room = BODY_CHUNK_SIZE - con->body_chunk_pos;
+    return (remaining < room) ? remaining : room;
+}
+
+/* Submits the operation the connection's state calls for. Only one operation per connection is in flight. */
+static void
+connection_arm_uring(loop_t *loop, connection_t *con)
+{
+    if (con->state == CON_CLOSED || con->op != URING_OP_NONE) {
+        return;
+    }
 
-    for (int i = 1; i < CONNECTION_SLOTS_COUNT + 1; i++) {
-        poll_data[i].fd = -1;
+    long token = connection_token(loop, con);
+    switch (con->state) {
+        case CON_RECEIVING_HEADERS: {
+            uring_prep_recv(loop->uring, con->sock, &con->buf[con->bufpos], REQUEST_BUFFER_SIZE - con->bufpos, token);
+            con->op = URING_OP_RECV;
+        } break;
+        case CON_RECEIVING_BODY: {
+            uring_prep_recv(loop->uring, con->sock, &con->body_chunk[con->body_chunk_pos], body_chunk_len(con), token);
+            con->op = URING_OP_RECV;
+        } break;
+        case CON_SENDING_RESPONSE: {
+            handler_t *h = &con->h;
+            if (h->handler_pending) {
+                int n = h->handler_pending(&h->args, con->iov, HANDLER_MAX_IOV);
+                uring_prep_writev(loop->uring, con->sock, con->iov, n, token);
+                con->op = URING_OP_WRITEV;
+            } else {
+                /* Handlers that do their own writes are run when the socket becomes writable. */
+                uring_prep_poll_add(loop->uring, con->sock, POLLOUT, token);
+                con->op = URING_OP_POLL;
+            }
+        } break;
+        default: break;
     }
-    poll_data[0].fd = listening_socket;
-    poll_data[0].events = POLLIN;
-    int active_slot_with_highest_index = 0;
+}
 
-    int nevents;
-    while ((nevents = poll(poll_data, active_slot_with_highest_index + 1, -1)) >= 0) {
-        if (nevents == 0) {
-            continue;
+/*
+ * Hysteresis between the high and low watermarks keeps the loop from flapping
+ * in and out of shedding when the load hovers around a limit.
+ */
+static int
+check_overload(loop_t *loop)
+{
+    if (!loop->overloaded) {
+        if (loop->active_connections >= OVERLOAD_HIGH_CONNECTIONS || loop->queued_bytes >= OVERLOAD_HIGH_QUEUED_BYTES) {
+            loop->overloaded = 1;
+            fprintf(stderr, "Overloaded with %d connections and %ld queued response bytes, rejecting new connections.\n", loop->active_connections, loop->queued_bytes);
         }
+    } else if (loop->active_connections <= OVERLOAD_LOW_CONNECTIONS && loop->queued_bytes <= OVERLOAD_LOW_QUEUED_BYTES) {
+        loop->overloaded = 0;
+        fprintf(stderr, "Load below low watermarks, accepting connections again.\n");
+    }
+    return loop->overloaded;
+}
 
-        /* Event on listening socket. */
-        if (poll_data[0].revents > 0) {
-            nevents--;
+/*
+ * Answers a connection that won't be served with the prebuilt 503 and closes it.
+ * This is best effort: the response fits in the send buffer of a new socket,
+ * but if part of the request already arrived, closing with it unread resets
+ * the connection and the client may never see the response. Lingering to
+ * drain the request would hold on to the resources that are running out.
+ */
+static void
+shed_connection(loop_t *loop, int sock)
+{
+    /*
+     * The result isn't checked: a failed or short write leaves the client
+     * with a reset, the socket is closed either way, and logging it would add
+     * a line per shed connection while overloaded.
+     */
+    write(sock, loop->overload_resp, loop->overload_resp_len);
+    close(sock);
+}
 
-            if (poll_data[0].revents != POLLIN) {
-                fprintf(stderr, "Unexpected poll event on listening socket: %d\n", poll_data[0].revents);
-                exit(1);
-            }
+/*
+ * Out of file descriptors: the pending connection can't be accepted, but
+ * leaving it in the queue would keep the listener readable and spin the loop.
+ * Give up the spare descriptor, accept the connection, close it and take the
+ * spare back.
+ * Returns 0 if a connection was dropped, 1 if there was none to drop.
+ */
+static int
+drop_connection_with_spare_fd(loop_t *loop)
+{
+    if (loop->spare_fd < 0) {
+        return 1;
+    }
+    close(loop->spare_fd);
+    int sock = accept(loop->listening_socket, NULL, NULL);
+    if (sock >= 0) {
+        close(sock);
+    }
+    loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (sock >= 0) ? 0 : 1;
+}
+
+/* Accepts connections until the listen queue is drained. */
+static void
+handle_listener_event(loop_t *loop, unsigned int revents)
+{
+    if (revents != POLLER_IN) {
+        fprintf(stderr, "Unexpected poll event on listening socket: %u\n", revents);
+        exit(1);
+    }
 
-            int poll_index = -1;
-            if (active_connections < CONNECTION_SLOTS_COUNT) {
-                for (int i = 1; i < CONNECTION_SLOTS_COUNT + 1; i++) {
-                    if (poll_data[i].fd < 0) {
-                        poll_index = i;
-                        break;
-                    }
+    while (1) {
+        int sock = accept4(loop->listening_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                /* accept() fails this way even when the queue is empty, so stop once nothing was dropped. */
+                if (drop_connection_with_spare_fd(loop) != 0) {
+                    return;
                 }
+                fprintf(stderr, "handle_listener_event: Out of file descriptors, dropped connection.\n");
+                continue;
             }
+            perror("handle_listener_event: accept4()");
+            return;
+        }
 
-            if (poll_index == -1) {
-                fprintf(stderr, "Ran out of connection slots.\n");
-            } else {
-                int sock = accept_connection(listening_socket);
-
-                struct pollfd *poll_slot = &poll_data[poll_index];
-                poll_slot->fd = sock;
-                poll_slot->events = POLLIN;
-                active_connections++;
-                if (poll_index > active_slot_with_highest_index) {
-                    active_slot_with_highest_index = poll_index;
-                }
+        if (check_overload(loop)) {
+            shed_connection(loop, sock);
+            continue;
+        }
 
-                connection_t *con = &cons[poll_index - 1];
-                con->sock = sock;
-                con->state = CON_RECEIVING_HEADERS;
-            }
+        connection_t *con = alloc_connection(loop);
+        if (!con) {
+            fprintf(stderr, "Ran out of connection slots, rejecting new connections.\n");
+            loop->overloaded = 1;
+            shed_connection(loop, sock);
+            continue;
         }
 
-        for (int i = 1; i < CONNECTION_SLOTS_COUNT + 1 && nevents > 0; i++) {
-            struct pollfd *poll_slot = &poll_data[i];
-            if (poll_slot->fd < 0 || poll_slot->revents == 0) {
-                continue;
-            }
+        con->sock = sock;
+        con->state = CON_RECEIVING_HEADERS;
+        loop->active_connections++;
+        connection_set_deadline(loop, con, HEADER_TIMEOUT_MS);
+        if (loop->poller) {
+            poller_add(loop->poller, sock, POLLER_IN, connection_token(loop, con));
+        } else {
+            connection_arm_uring(loop, con);
+        }
+    }
+}
 
-            nevents--;
-            connection_t *con = &cons[i - 1];
+/* Called once the handler for the response is set up. */
+static void
+start_response(loop_t *loop, connection_t *con)
+{
+    con->state = CON_SENDING_RESPONSE;
+    connection_set_events(loop, con, POLLER_OUT);
+    connection_set_deadline(loop, con, SEND_TIMEOUT_MS);
 
-            if (poll_slot->revents & (POLLERR | POLLHUP | POLLNVAL)) {
-                fprintf(stderr, "Unexpected event on slot %d: %d\n", i, poll_slot->revents);
-                close_connection(con, poll_data, i, &active_connections, &active_slot_with_highest_index);
-                continue;
+    con->resp_bytes = con->h.resp_size;
+    loop->queued_bytes += con->resp_bytes;
+}
+
+static void
+respond_error_400(loop_t *loop, connection_t *con)
+{
+    /* Framing of anything that follows a malformed request can't be trusted. */
+    con->h.keep_alive = 0;
+    serve_error_400(&con->h);
+    start_response(loop, con);
+}
+
+/*
+ * Runs on the disk pool. Feeds the next part of the request body to the form
+ * parser, which writes file parts to disk, and routes the request once the
+ * whole body is parsed, or right away if it has no body.
+ */
+static void
+run_request_job(disk_job_t *job)
+{
+    request_job_t *rj = (request_job_t *)job;
+    request_t *req = &rj->req;
+    handler_t *h = &rj->h;
+
+    if (!req->form) {
+        do_routing(h, req);
+        rj->routed = 1;
+        return;
+    }
+
+    req->body_bufpos += rj->len;
+    enum multipart_result ret = multipart_feed(req->form, rj->data, rj->len);
+    if (ret == MULTIPART_CONTINUE && req->body_bufpos < req->content_length) {
+        return;
+    }
+    if (ret == MULTIPART_CONTINUE) {
+        ret = multipart_finish(req->form);
+    }
+
+    if (ret == MULTIPART_DONE) {
+        do_routing(h, req);
+    } else if (ret == MULTIPART_IO_ERROR) {
+        h->keep_alive = 0;
+        serve_error_500(h);
+    } else {
+        /* The rest of the body is left unread, so the connection can't be reused. */
+        fprintf(stderr, "run_request_job: Invalid form data.\n");
+        h->keep_alive = 0;
+        serve_error_400(h);
+    }
+    /* Temporary files that weren't claimed by the route are removed here, off the loop as well. */
+    multipart_free(req->form);
+    req->form = NULL;
+    rj->routed = 1;
+}
+
+/* Hands the connection's request to the disk pool, with the next len bytes of its body at data. */
+static void
+submit_request_job(loop_t *loop, connection_t *con, const char *data, long len)
+{
+    request_job_t *rj = calloc(1, sizeof(request_job_t));
+    if (!rj) {
+        fprintf(stderr, "submit_request_job: calloc() failed.\n");
+        exit(1);
+    }
+    rj->job.fun = run_request_job;
+    rj->req = con->req;
+    rj->h = con->h;
+    rj->data = data;
+    rj->len = len;
+
+    con->state = CON_WAITING_DISK;
+    timer_wheel_cancel(loop->timers, connection_token(loop, con));
+    if (loop->poller) {
+        poller_del(loop->poller, con->sock);
+    }
+    disk_pool_submit(loop->disk, &rj->job, connection_token(loop, con));
+}
+
+/*
+ * Called after n more bytes of the body were read into body_chunk. They're
+ * only handed to the disk pool once the chunk is full or the body is
+ * complete, so a client trickling the body doesn't cost a job per read.
+ */
+static void
+body_received(loop_t *loop, connection_t *con, long n)
+{
+    con->body_chunk_pos += n;
+    if (body_chunk_len(con) > 0) {
+        return;
+    }
+    long len = con->body_chunk_pos;
+    con->body_chunk_pos = 0;
+    submit_request_job(loop, con, con->body_chunk, len);
+}
+
+/* Resumes the connection whose request job is done, with the response or by receiving more of the body. */
+static void
+request_job_done(loop_t *loop, request_job_t *rj)
+{
+    connection_t *con = &loop->cons[rj->job.token];
+    con->req = rj->req;
+    con->h = rj->h;
+    int routed = rj->routed;
+    free(rj);
+
+    if (loop->poller) {
+        poller_add(loop->poller, con->sock, POLLER_IN, connection_token(loop, con));
+    }
+    if (routed) {
+        end_request_body(con);
+        start_response(loop, con);
+    } else {
+        con->state = CON_RECEIVING_BODY;
+        if (con->body_deadline <= loop->now) {
+            close_connection(loop, con);
+            return;
+        }
+        timer_wheel_schedule(loop->timers, connection_token(loop, con), con->body_deadline);
+    }
+    if (loop->uring) {
+        connection_arm_uring(loop, con);
+    }
+}
+
+static void
+handle_disk_completions(loop_t *loop)
+{
+    disk_job_t *job = disk_queue_take(loop->disk);
+    while (job) {
+        disk_job_t *next = job->next;
+        request_job_done(loop, (request_job_t *)job);
+        job = next;
+    }
+}
+
+/* Called once the headers section of a request is in con->buf. */
+static void
+start_request(loop_t *loop, connection_t *con, long headers_len, long rem_len)
+{
+    con->req_end = headers_len;
+
+    int ret = parse_headers(&con->req, con->buf, headers_len);
+    if (ret != 0) {
+        respond_error_400(loop, con);
+        return;
+    }
+
+    con->h.keep_alive = con->req.keep_alive && con->nrequests + 1 < MAX_REQUESTS_PER_CONNECTION;
+
+    //char *meth = (con->req.meth == RM_GET) ? "GET" : (con->req.meth == RM_POST) ? "POST" : "HEAD";
+    //printf("%s %s %s\n", meth, con->req.path, (con->req.params) ? con->req.params : "");
+
+    if (con->req.meth == RM_POST) {
+
+        int ret = validate_post_request(&con->req);
+        if (ret != VALIDATE_POST_REQUEST_OK) {
+            if (ret == VALIDATE_POST_REQUEST_400) {
+                /* The body is left unread, so the connection can't be reused. */
+                respond_error_400(loop, con);
+                return;
+            } else {
+                exit(1);
             }
+        }
 
-            if (con->state == CON_CLOSED) {
-                continue;
+        /*
+         * Whatever part of the body was received with the headers is parsed from con->buf, anything after the body is the next request.
+         * The body is parsed on the disk pool, since file parts are written out as they arrive.
+         */
+        long nbody = (con->req.content_length < rem_len) ? con->req.content_length : rem_len;
+        con->req_end = headers_len + nbody;
+        con->req.form = multipart_create(con->req.boundary, "uploads");
+
+        if (nbody < con->req.content_length) {
+            con->body_chunk = malloc(BODY_CHUNK_SIZE);
+            if (!con->body_chunk) {
+                fprintf(stderr, "start_request: malloc() failed.\n");
+                exit(1);
             }
+            con->body_chunk_pos = 0;
+            con->state = CON_RECEIVING_BODY;
+            con->body_deadline = loop->now + BODY_TIMEOUT_MS;
+            timer_wheel_schedule(loop->timers, connection_token(loop, con), con->body_deadline);
+        }
+        if (nbody > 0 || nbody == con->req.content_length) {
+            submit_request_job(loop, con, &con->buf[headers_len], nbody);
+        }
 
-            if (con->state == CON_RECEIVING_HEADERS) {
-                long headers_len;
-                long rem_len;
-
-                {
-                    enum read_headers_result ret = read_headers(con->sock, &con->headers_end_state, con->buf, &con->bufpos, REQUEST_BUFFER_SIZE, &headers_len, &rem_len);
-                    if (ret != READ_HEADERS_DONE) {
-                        if (ret == READ_HEADERS_CONTINUE) {
-                            continue;
-                        } else if (ret == READ_HEADERS_FAILED_CLOSE_CONNECTION) {
-                            close_connection(con, poll_data, i, &active_connections, &active_slot_with_highest_index);
-                            continue;
-                        } else if (ret == READ_HEADERS_FAILED_SEND_400) {
-                            serve_error_400(&con->h);
-                            con->state = CON_SENDING_RESPONSE;
-                            poll_slot->events = POLLOUT;
-                            goto sending_response;
-                        }
-                    }
-                }
+    } else if (try_routing(&con->h, &con->req) != 0) {
+        submit_request_job(loop, con, NULL, 0);
+    } else {
+        start_response(loop, con);
+    }
+}
 
-                int ret = parse_headers(&con->req, con->buf, headers_len);
-                if (ret != 0) {
-                    serve_error_400(&con->h);
-                    con->state = CON_SENDING_RESPONSE;
-                    poll_slot->events = POLLOUT;
-                    goto sending_response;
-                }
+/* Response was sent on a persistent connection, start on the next request if it's already buffered. */
+static void
+finish_request(loop_t *loop, connection_t *con)
+{
+    reset_connection(loop, con);
+    if (con->bufpos == 0) {
+        return;
+    }
 
-                //char *meth = (con->req.meth == RM_GET) ? "GET" : (con->req.meth == RM_POST) ? "POST" : "HEAD";
-                //printf("%s %s %s\n", meth, con->req.path, (con->req.params) ? con->req.params : "");
-
-                if (con->req.meth == RM_POST) {
-
-                    int ret = validate_post_request(&con->req);
-                    if (ret != VALIDATE_POST_REQUEST_OK) {
-                        if (ret == VALIDATE_POST_REQUEST_400) {
-                            serve_error_400(&con->h);
-                            con->state = CON_SENDING_RESPONSE;
-                            poll_slot->events = POLLOUT;
-                            goto sending_response;
-                        } else {
-                            exit(1);
-                        }
-                    }
-
-                    if (con->req.content_length == rem_len) {
-                        con->req.body_buf = &con->buf[headers_len];
-                        con->req.body_bufpos = rem_len;
-
-                        do_routing(&con->h, &con->req);
-                        con->state = CON_SENDING_RESPONSE;
-                        poll_slot->events = POLLOUT;
-                    } else {
-                        con->req.body_buf = malloc(con->req.content_length);
-                        if (!con->req.body_buf) {
-                            fprintf(stderr, "handle_connections: malloc() failed.\n");
-                        }
-                        con->req.body_bufpos = rem_len;
-                        memcpy(con->req.body_buf, &con->buf[headers_len], rem_len);
-
-                        con->state = CON_RECEIVING_BODY;
-                        poll_slot->events = POLLOUT;
-                    }
+    long headers_len;
+    long rem_len;
+    enum read_headers_result ret = find_headers_end(&con->headers_end_state, con->buf, 0, con->bufpos, REQUEST_BUFFER_SIZE, &headers_len, &rem_len);
+    if (ret == READ_HEADERS_DONE) {
+        start_request(loop, con, headers_len, rem_len);
+    } else if (ret == READ_HEADERS_FAILED_SEND_400) {
+        respond_error_400(loop, con);
+    }
+}
 
-                } else {
-                    do_routing(&con->h, &con->req);
-                    con->state = CON_SENDING_RESPONSE;
-                    poll_slot->events = POLLOUT;
-                }
+/* Called after new bytes were appended to con->buf, ret is the result of scanning them. */
+static void
+headers_received(loop_t *loop, connection_t *con, enum read_headers_result ret, long headers_len, long rem_len)
+{
+    if (con->idle && con->bufpos > 0) {
+        con->idle = 0;
+        connection_set_deadline(loop, con, HEADER_TIMEOUT_MS);
+    }
+    if (ret == READ_HEADERS_DONE) {
+        start_request(loop, con, headers_len, rem_len);
+    } else if (ret == READ_HEADERS_FAILED_CLOSE_CONNECTION) {
+        close_connection(loop, con);
+    } else if (ret == READ_HEADERS_FAILED_SEND_400) {
+        respond_error_400(loop, con);
+    }
+}
+
+/* Called with the handler's result after some of the response was sent. */
+static void
+response_progress(loop_t *loop, connection_t *con, int ret)
+{
+    if (ret == 1) {
+        return;
+    }
+    if (ret == 0 && con->h.keep_alive) {
+        finish_request(loop, con);
+    } else {
+        close_connection(loop, con);
+    }
+}
+
+static void
+handle_connection_event(loop_t *loop, connection_t *con, unsigned int revents)
+{
+    if (revents & POLLER_ERR) {
+        fprintf(stderr, "Unexpected event on slot %ld: %u\n", connection_token(loop, con), revents);
+        close_connection(loop, con);
+        return;
+    }
+
+    if (con->state == CON_CLOSED) {
+        return;
+    }
+
+    if (con->state == CON_RECEIVING_HEADERS) {
+        long headers_len;
+        long rem_len;
+        enum read_headers_result ret = read_headers(con->sock, &con->headers_end_state, con->buf, &con->bufpos, REQUEST_BUFFER_SIZE, &headers_len, &rem_len);
+        headers_received(loop, con, ret, headers_len, rem_len);
+    }
 
+    if (con->state == CON_RECEIVING_BODY) {
+        long nread = read(con->sock, &con->body_chunk[con->body_chunk_pos], body_chunk_len(con));
+        if (nread == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
             }
 
-            if (con->state == CON_RECEIVING_BODY) {
-                long nread = read(con->sock, &con->req.body_buf[con->req.body_bufpos], con->req.content_length - con->req.body_bufpos);
-                if (nread == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        goto cont;
-                    }
-
-                    perror("handle_connections: read()");
-                    free_body_buffer(con->buf, con->req.body_buf);
-                    close_connection(con, poll_data, i, &active_connections, &active_slot_with_highest_index);
-                    goto cont;
+            perror("handle_connection_event: read()");
+            close_connection(loop, con);
+            return;
+        }
+        if (nread == 0) {
+            fprintf(stderr, "handle_connection_event: Received less bytes than expected.\n");
+            close_connection(loop, con);
+            return;
+        }
+        body_received(loop, con, nread);
+    }
+
+    /* Pipelined requests that are already buffered are answered in order without waiting for another event. */
+    while (con->state == CON_SENDING_RESPONSE) {
+        handler_t *h = &con->h;
+        if (!h->handler || !h->handler_after) {
+            fprintf(stderr, "handle_connection_event: Invalid handler.\n");
+            exit(1);
+        }
+        int ret = h->handler(con->sock, &h->args);
+        if (ret == 1) {
+            break;
+        }
+        response_progress(loop, con, ret);
+    }
+}
+
+/* io_uring counterpart of handle_connection_event(), res is the result of the connection's operation. */
+static void
+handle_connection_completion(loop_t *loop, connection_t *con, int res)
+{
+    enum uring_op op = con->op;
+    con->op = URING_OP_NONE;
+
+    if (con->closing) {
+        con->closing = 0;
+        close_connection(loop, con);
+        return;
+    }
+
+    if (res == -EAGAIN && (op == URING_OP_RECV || op == URING_OP_WRITEV)) {
+        uring_prep_poll_add(loop->uring, con->sock, (op == URING_OP_RECV) ? POLLIN : POLLOUT, connection_token(loop, con));
+        con->op = URING_OP_POLL;
+        return;
+    }
+
+    switch (op) {
+        case URING_OP_RECV: {
+            if (con->state == CON_RECEIVING_HEADERS) {
+                long headers_len = 0;
+                long rem_len = 0;
+                enum read_headers_result ret;
+                if (res < 0) {
+                    fprintf(stderr, "handle_connection_completion: recv: %s\n", strerror(-res));
+                    ret = READ_HEADERS_FAILED_CLOSE_CONNECTION;
+                } else if (res == 0) {
+                    ret = (con->bufpos == 0) ? READ_HEADERS_FAILED_CLOSE_CONNECTION : READ_HEADERS_FAILED_SEND_400;
+                } else {
+                    long scanpos = con->bufpos;
+                    con->bufpos += res;
+                    ret = find_headers_end(&con->headers_end_state, con->buf, scanpos, con->bufpos, REQUEST_BUFFER_SIZE, &headers_len, &rem_len);
                 }
-                con->req.body_bufpos += nread;
-                int done_receiving = con->req.body_bufpos == con->req.content_length;
-                if (nread == 0 && !done_receiving) {
-                    fprintf(stderr, "handle_connections: Received less bytes than expected.\n");
-                    free_body_buffer(con->buf, con->req.body_buf);
-                    close_connection(con, poll_data, i, &active_connections, &active_slot_with_highest_index);
-                    goto cont;
+                headers_received(loop, con, ret, headers_len, rem_len);
+            } else if (con->state == CON_RECEIVING_BODY) {
+                if (res < 0) {
+                    fprintf(stderr, "handle_connection_completion: recv: %s\n", strerror(-res));
+                    close_connection(loop, con);
+                    return;
                 }
-                if (done_receiving) {
-                    do_routing(&con->h, &con->req);
-                    free_body_buffer(con->buf, con->req.body_buf);
-                    con->state = CON_SENDING_RESPONSE;
+                if (res == 0) {
+                    fprintf(stderr, "handle_connection_completion: Received less bytes than expected.\n");
+                    close_connection(loop, con);
+                    return;
                 }
+                body_received(loop, con, res);
             }
+        } break;
 
-            if (con->state == CON_SENDING_RESPONSE) {
-sending_response:;
-                handler_t *h = &con->h;
-                if (!h->handler || !h->handler_after) {
-                    fprintf(stderr, "handle_connections: Invalid handler.\n");
-                    exit(1);
-                }
-                int ret = h->handler(con->sock, &h->args);
-                if (ret == 0 || ret == -1) {
-                    h->handler_after(&h->args);
-                    close_connection(con, poll_data, i, &active_connections, &active_slot_with_highest_index);
-                }
+        case URING_OP_WRITEV: {
+            if (res < 0) {
+                fprintf(stderr, "handle_connection_completion: writev: %s\n", strerror(-res));
+                close_connection(loop, con);
+                return;
+            }
+            handler_t *h = &con->h;
+            h->handler_advance(&h->args, res);
+            if (h->handler_pending(&h->args, con->iov, HANDLER_MAX_IOV) == 0) {
+                response_progress(loop, con, 0);
+            }
+        } break;
+
+        case URING_OP_POLL: {
+            if (res < 0) {
+                close_connection(loop, con);
+                return;
+            }
+            if (con->state == CON_SENDING_RESPONSE && !con->h.handler_pending) {
+                response_progress(loop, con, con->h.handler(con->sock, &con->h.args));
+            }
+        } break;
+
+        default: break;
+    }
+
+    connection_arm_uring(loop, con);
+}
+
+static void
+run_poller_loop(loop_t *loop)
+{
+    poller_add(loop->poller, loop->listening_socket, POLLER_IN, LISTENER_TOKEN);
+    poller_add(loop->poller, disk_queue_fd(loop->disk), POLLER_IN, DISK_TOKEN);
+    if (loop->watch_fd >= 0) {
+        poller_add(loop->poller, loop->watch_fd, POLLER_IN, WATCH_TOKEN);
+    }
+
+    poller_event_t events[POLLER_MAX_EVENTS];
+    while (1) {
+        int timeout = expire_connections(loop);
+        int nevents = poller_wait(loop->poller, events, POLLER_MAX_EVENTS, timeout);
+        loop->now = get_monotonic_ms();
+
+        /*
+         * Only ready connections are visited. New connections are accepted
+         * after the batch is dispatched so that a slot freed by an earlier event
+         * can't be handed out while a stale event for it is still pending.
+         */
+        unsigned int listener_revents = 0;
+        for (int i = 0; i < nevents; i++) {
+            if (events[i].token == LISTENER_TOKEN) {
+                listener_revents = events[i].events;
+                continue;
+            }
+            if (events[i].token == DISK_TOKEN) {
+                handle_disk_completions(loop);
+                continue;
             }
-cont:;
+            if (events[i].token == WATCH_TOKEN) {
+                resource_cache_handle_watch_events(loop->watch_fd);
+                continue;
+            }
+            handle_connection_event(loop, &loop->cons[events[i].token], events[i].events);
+        }
+
+        if (listener_revents) {
+            handle_listener_event(loop, listener_revents);
         }
     }
 }
 
+/*
+ * Reads and writes are submitted as io_uring operations and every loop
+ * iteration hands all of them to the kernel with a single system call.
+ * The listener is still driven by readiness and drained with accept4().
+ */
 static void
-run_server(void)
+run_uring_loop(loop_t *loop)
 {
-    signal(SIGPIPE, SIG_IGN);
+    uring_prep_poll_add(loop->uring, loop->listening_socket, POLLIN, LISTENER_TOKEN);
+    uring_prep_poll_add(loop->uring, disk_queue_fd(loop->disk), POLLIN, DISK_TOKEN);
+    if (loop->watch_fd >= 0) {
+        uring_prep_poll_add(loop->uring, loop->watch_fd, POLLIN, WATCH_TOKEN);
+    }
+
+    while (1) {
+        int timeout = expire_connections(loop);
+        uring_submit_and_wait(loop->uring, timeout);
+        loop->now = get_monotonic_ms();
+
+        int listener_ready = 0;
+        long token;
+        int res;
+        while (uring_next_completion(loop->uring, &token, &res)) {
+            if (token == LISTENER_TOKEN) {
+                listener_ready = 1;
+            } else if (token == DISK_TOKEN) {
+                handle_disk_completions(loop);
+                uring_prep_poll_add(loop->uring, disk_queue_fd(loop->disk), POLLIN, DISK_TOKEN);
+            } else if (token == WATCH_TOKEN) {
+                resource_cache_handle_watch_events(loop->watch_fd);
+                uring_prep_poll_add(loop->uring, loop->watch_fd, POLLIN, WATCH_TOKEN);
+            } else if (token != CANCEL_TOKEN) {
+                handle_connection_completion(loop, &loop->cons[token], res);
+            }
+        }
+
+        if (listener_ready) {
+            handle_listener_event(loop, POLLER_IN);
+            uring_prep_poll_add(loop->uring, loop->listening_socket, POLLIN, LISTENER_TOKEN);
+        }
+    }
+}
+
+static void
+handle_connections(int listening_socket, enum poller_backend backend, const int use_uring, int watch_fd)
+{
+    loop_t *loop = calloc(1, sizeof(loop_t));
+    if (!loop) {
+        fprintf(stderr, "handle_connections: calloc() failed.\n");
+        exit(1);
+    }
+    loop->listening_socket = listening_socket;
+    loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (loop->spare_fd < 0) {
+        perror("handle_connections: open()");
+        exit(1);
+    }
+    loop->free_head = -1;
+    loop->now = get_monotonic_ms();
+    loop->timers = timer_wheel_create(loop->now);
+    loop->overload_resp_len = write_overload_response(loop->overload_resp, OVERLOAD_RETRY_AFTER_SECONDS);
+    loop->disk = disk_queue_create();
+    loop->watch_fd = watch_fd;
+
+    if (use_uring) {
+        loop->uring = uring_create(URING_ENTRIES);
+        if (!loop->uring) {
+            fprintf(stderr, "handle_connections: io_uring unavailable, falling back to %s.\n", poller_backend_name(backend));
+        }
+    }
+    if (!loop->uring) {
+        loop->poller = poller_create(backend);
+    }
+
+    if (grow_connection_table(loop) != 0) {
+        fprintf(stderr, "handle_connections: Failed to allocate connection table.\n");
+        exit(1);
+    }
+
+    if (loop->uring) {
+        run_uring_loop(loop);
+    } else {
+        run_poller_loop(loop);
+    }
+}
 
+static int
+create_listening_socket(const int reuseport, const int backlog)
+{
     int sock;
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("socket");
         exit(1);
     }
@@ -321,6 +1012,11 @@ run_server(void)
         perror("setsockopt");
         exit(1);
     }
+    /* Every worker binds its own socket to the port and the kernel spreads incoming connections between them. */
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int))) {
+        perror("setsockopt");
+        exit(1);
+    }
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -329,20 +1025,147 @@ run_server(void)
         perror("bind");
         exit(1);
     }
-    if (listen(sock, 10) < 0) {
+    if (listen(sock, backlog) < 0) {
         perror("listen");
         exit(1);
     }
 
-    handle_connections(sock);
+    return sock;
+}
+
+typedef struct {
+    pthread_t thread;
+    int listening_socket;
+    enum poller_backend poller_backend;
+    int use_uring;
+    int watch_fd;
+} worker_t;
+
+static void *
+worker_main(void *arg)
+{
+    worker_t *w = arg;
+    handle_connections(w->listening_socket, w->poller_backend, w->use_uring, w->watch_fd);
+    return NULL;
+}
+
+static void
+run_server(const options_t *opts)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Templates and pages read from disk are reloaded when they change, by the first worker's loop. */
+    int watch_fd = opts->assets_from_disk ? resource_cache_watch() : -1;
+
+    if (opts->workers == 1) {
+        handle_connections(create_listening_socket(0, opts->backlog), opts->poller_backend, opts->use_uring, watch_fd);
+        return;
+    }
+
+    worker_t *workers = calloc(opts->workers, sizeof(worker_t));
+    if (!workers) {
+        fprintf(stderr, "run_server: calloc() failed.\n");
+        exit(1);
+    }
+
+    /* All listeners are bound before any worker starts, so a busy port fails at startup. */
+    for (int i = 0; i < opts->workers; i++) {
+        workers[i].listening_socket = create_listening_socket(1, opts->backlog);
+        workers[i].poller_backend = opts->poller_backend;
+        workers[i].use_uring = opts->use_uring;
+        workers[i].watch_fd = (i == 0) ? watch_fd : -1;
+    }
+
+    for (int i = 1; i < opts->workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "run_server: pthread_create() failed.\n");
+            exit(1);
+        }
+    }
+    worker_main(&workers[0]);
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--poller poll|epoll|uring] [--workers n] [--backlog n] [--assets embedded|disk]\n", argv0);
+    exit(1);
+}
+
+static void
+parse_options(int argc, char **argv, options_t *opts)
+{
+    const char *poller_str = DEFAULT_POLLER_BACKEND;
+    const char *assets_str = DEFAULT_ASSETS;
+    opts->workers = DEFAULT_WORKERS;
+    opts->backlog = LISTEN_BACKLOG;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--poller") == 0 && i + 1 < argc) {
+            poller_str = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            long l;
+            long *lp = &l;
+            parse_long(&lp, argv[++i]);
+            if (!lp || l < 0 || l > MAX_WORKERS) {
+                fprintf(stderr, "Invalid number of workers: %s.\n", argv[i]);
+                usage(argv[0]);
+            }
+            opts->workers = l;
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            long l;
+            long *lp = &l;
+            parse_long(&lp, argv[++i]);
+            if (!lp || l < 1 || l > 65535) {
+                fprintf(stderr, "Invalid listen backlog: %s.\n", argv[i]);
+                usage(argv[0]);
+            }
+            opts->backlog = l;
+        } else if (strcmp(argv[i], "--assets") == 0 && i + 1 < argc) {
+            assets_str = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (strcmp(poller_str, "uring") == 0) {
+        /* io_uring falls back to epoll at runtime if the kernel doesn't support it. */
+        opts->use_uring = 1;
+        opts->poller_backend = POLLER_BACKEND_EPOLL;
+    } else if (poller_backend_from_string(poller_str, &opts->poller_backend) != 0) {
+        fprintf(stderr, "Invalid poller backend: %s.\n", poller_str);
+        usage(argv[0]);
+    }
+
+    if (strcmp(assets_str, "disk") == 0) {
+        opts->assets_from_disk = 1;
+    } else if (strcmp(assets_str, "embedded") != 0) {
+        fprintf(stderr, "Invalid assets source: %s.\n", assets_str);
+        usage(argv[0]);
+    }
+
+    if (opts->workers == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opts->workers = (ncpus > 0 && ncpus <= MAX_WORKERS) ? ncpus : 1;
+    }
 }
 
 int
 main(int argc, char **argv)
 {
-    (void)(argc); (void)(argv);
+    options_t opts = {0};
+    parse_options(argc, argv, &opts);
 
     srand(time(NULL));
+    if (opts.assets_from_disk) {
+        resource_cache_use_disk();
+    }
     forum_init();
-    run_server();
+    response_init();
+    templating_init();
+    multipart_remove_stale_files("uploads");
+    upload_index_init("uploads");
+    disk_pool_start(DISK_POOL_THREADS);
+    reclaimer_start();
+    run_server(&opts);
 }
@@ -0,0 +1,528 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "multipart.h"
+#include "sha256.h"
+
+#define MULTIPART_PART_HEADERS_MAXSIZE 1024
+#define MULTIPART_FIELDS_MAXSIZE 1024 * 16 /* All text fields of a request together. */
+#define MULTIPART_FILE_BUFFER_SIZE 1024 * 64
+
+enum multipart_state {
+    MP_PART_DATA, /* Also the preamble, before the first part. */
+    MP_AFTER_DELIMITER,
+    MP_DELIMITER_LF,
+    MP_CLOSE_DASH,
+    MP_PART_HEADERS,
+    MP_EPILOGUE,
+    MP_FAILED,
+};
+
+/*
+ * Incremental multipart/form-data parser. The body is fed in chunks as it is
+ * received and only the current part's headers, the text fields and a write
+ * buffer for file parts are kept in memory, file parts are streamed into
+ * temporary files.
+ *
+ * Part data ends at CRLF "--" boundary. match counts how many bytes of that
+ * delimiter were seen at the end of the data so far; those bytes are held back
+ * until it's clear whether they belong to the data. The delimiter contains
+ * only one CR, so after a mismatch a new match can only start at a CR.
+ */
+struct multipart {
+    enum multipart_state state;
+    char delimiter[80];
+    int delimiter_len;
+    int match;
+    const char *tmp_dir;
+
+    char headers[MULTIPART_PART_HEADERS_MAXSIZE];
+    int headers_len;
+
+    multipart_part_t parts[MULTIPART_MAX_PARTS];
+    int nparts;
+    multipart_part_t *part; /* Part whose data is being received, NULL in the preamble. */
+
+    char *fields; /* Values of the text fields. */
+    long fields_len;
+
+    int fd; /* Temporary file of the current file part. */
+    char *filebuf;
+    long filebuf_len;
+    sha256_t hash; /* Of the current file part, updated as the buffer is flushed. */
+};
+
+/* boundary includes the leading "--". */
+multipart_t *
+multipart_create(const char *boundary, const char *tmp_dir)
+{
+    multipart_t *mp = calloc(1, sizeof(multipart_t));
+    if (!mp) {
+        fprintf(stderr, "multipart_create: calloc() failed.\n");
+        exit(1);
+    }
+
+    int len = strlen(boundary);
+    if (len + 2 + 1 > (int)sizeof(mp->delimiter)) {
+        fprintf(stderr, "multipart_create: Boundary too large.\n");
+        exit(1);
+    }
+    mp->delimiter[0] = '\r';
+    mp->delimiter[1] = '\n';
+    memcpy(&mp->delimiter[2], boundary, len + 1);
+    mp->delimiter_len = len + 2;
+
+    /* The first boundary doesn't follow a CRLF, start as if one was just seen. */
+    mp->state = MP_PART_DATA;
+    mp->match = 2;
+    mp->tmp_dir = tmp_dir;
+    mp->fd = -1;
+    return mp;
+}
+
+static enum multipart_result
+flush_file(multipart_t *mp)
+{
+    sha256_update(&mp->hash, mp->filebuf, mp->filebuf_len);
+
+    long pos = 0;
+    while (pos < mp->filebuf_len) {
+        long nwritten = write(mp->fd, &mp->filebuf[pos], mp->filebuf_len - pos);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("flush_file: write()");
+            return MULTIPART_IO_ERROR;
+        }
+        pos += nwritten;
+    }
+    mp->filebuf_len = 0;
+    return MULTIPART_CONTINUE;
+}
+
+/* Appends data to the value of the current part. */
+static enum multipart_result
+emit(multipart_t *mp, const char *data, long len)
+{
+    multipart_part_t *part = mp->part;
+    if (!part || len == 0) {
+        return MULTIPART_CONTINUE;
+    }
+
+    if (!part->is_file) {
+        if (mp->fields_len + len > MULTIPART_FIELDS_MAXSIZE) {
+            fprintf(stderr, "emit: Form fields too large.\n");
+            return MULTIPART_INVALID;
+        }
+        memcpy(&mp->fields[mp->fields_len], data, len);
+        mp->fields_len += len;
+        part->value_len += len;
+        return MULTIPART_CONTINUE;
+    }
+
+    if (part->size < MULTIPART_FILE_HEAD_SIZE) {
+        long l = MULTIPART_FILE_HEAD_SIZE - part->size;
+        memcpy(&part->head[part->size], data, (l < len) ? l : len);
+    }
+    part->size += len;
+
+    while (len > 0) {
+        long l = MULTIPART_FILE_BUFFER_SIZE - mp->filebuf_len;
+        if (l > len) {
+            l = len;
+        }
+        memcpy(&mp->filebuf[mp->filebuf_len], data, l);
+        mp->filebuf_len += l;
+        data += l;
+        len -= l;
+        if (mp->filebuf_len == MULTIPART_FILE_BUFFER_SIZE) {
+            enum multipart_result ret = flush_file(mp);
+            if (ret != MULTIPART_CONTINUE) {
+                return ret;
+            }
+        }
+    }
+    return MULTIPART_CONTINUE;
+}
+
+/* Case insensitive prefix match, returns the position after the prefix or NULL. */
+static const char *
+skip_prefix(const char *s, const char *prefix)
+{
+    while (*prefix) {
+        if (tolower((unsigned char)*s) != *prefix) {
+            return NULL;
+        }
+        s++;
+        prefix++;
+    }
+    return s;
+}
+
+/* Copies the value of a quoted parameter, s points after the '='. */
+static int
+copy_quoted(const char *s, char *out, int outsize)
+{
+    if (*s != '"') {
+        return 1;
+    }
+    s++;
+    int len = 0;
+    while (*s && *s != '"') {
+        if (len + 1 >= outsize) {
+            return 1;
+        }
+        out[len++] = *s++;
+    }
+    if (*s != '"') {
+        return 1;
+    }
+    out[len] = '\0';
+    return 0;
+}
+
+static int
+parse_content_disposition(const char *value, multipart_part_t *part)
+{
+    const char *t = skip_prefix(value, "form-data");
+    if (!t) {
+        return 1;
+    }
+    int has_name = 0;
+    while (*t) {
+        while (*t == ';' || *t == ' ') {
+            t++;
+        }
+        const char *v;
+        if ((v = skip_prefix(t, "name="))) {
+            if (copy_quoted(v, part->name, MULTIPART_NAME_MAXLEN) != 0) {
+                return 1;
+            }
+            has_name = 1;
+        } else if ((v = skip_prefix(t, "filename="))) {
+            part->is_file = 1;
+        }
+        /* Skip to the next parameter, semicolons inside quotes don't end it. */
+        int quoted = 0;
+        while (*t && (quoted || *t != ';')) {
+            if (*t == '"') {
+                quoted = !quoted;
+            }
+            t++;
+        }
+    }
+    return has_name ? 0 : 1;
+}
+
+/* headers holds the part's header lines, NUL terminated, with the final empty line removed. */
+static int
+parse_part_headers(char *headers, multipart_part_t *part)
+{
+    int has_disposition = 0;
+    char *line = headers;
+    while (*line) {
+        char *end = strstr(line, "\r\n");
+        if (!end) {
+            end = line + strlen(line);
+        } else {
+            *end = '\0';
+            end += 2;
+        }
+
+        const char *v;
+        if ((v = skip_prefix(line, "content-disposition:"))) {
+            while (*v == ' ') {
+                v++;
+            }
+            if (parse_content_disposition(v, part) != 0) {
+                fprintf(stderr, "parse_part_headers: Invalid Content-Disposition.\n");
+                return 1;
+            }
+            has_disposition = 1;
+        } else if ((v = skip_prefix(line, "content-type:"))) {
+            while (*v == ' ') {
+                v++;
+            }
+            int len = 0;
+            while (v[len] && v[len] != ';' && v[len] != ' ' && len + 1 < MULTIPART_CONTENT_TYPE_MAXLEN) {
+                part->content_type[len] = tolower((unsigned char)v[len]);
+                len++;
+            }
+            part->content_type[len] = '\0';
+            part->is_file = 1;
+        }
+        line = end;
+    }
+    return has_disposition ? 0 : 1;
+}
+
+static enum multipart_result
+begin_part(multipart_t *mp)
+{
+    if (mp->nparts == MULTIPART_MAX_PARTS) {
+        fprintf(stderr, "begin_part: Too many parts.\n");
+        return MULTIPART_INVALID;
+    }
+    multipart_part_t *part = &mp->parts[mp->nparts];
+    memset(part, 0, sizeof(multipart_part_t));
+
+    mp->headers[mp->headers_len - 2] = '\0';
+    if (parse_part_headers(mp->headers, part) != 0) {
+        return MULTIPART_INVALID;
+    }
+    mp->nparts++;
+
+    if (part->is_file) {
+        int len = snprintf(part->path, MULTIPART_PATH_MAXLEN, "%s/.part-XXXXXX", mp->tmp_dir);
+        if (len + 1 > MULTIPART_PATH_MAXLEN) {
+            fprintf(stderr, "begin_part: Path buffer too small.\n");
+            exit(1);
+        }
+        mp->fd = mkstemp(part->path);
+        if (mp->fd < 0) {
+            perror("begin_part: mkstemp()");
+            part->path[0] = '\0';
+            return MULTIPART_IO_ERROR;
+        }
+        fchmod(mp->fd, 0644);
+        sha256_init(&mp->hash);
+        if (!mp->filebuf) {
+            mp->filebuf = malloc(MULTIPART_FILE_BUFFER_SIZE);
+            if (!mp->filebuf) {
+                fprintf(stderr, "begin_part: malloc() failed.\n");
+                exit(1);
+            }
+        }
+    } else {
+        if (!mp->fields) {
+            mp->fields = malloc(MULTIPART_FIELDS_MAXSIZE);
+            if (!mp->fields) {
+                fprintf(stderr, "begin_part: malloc() failed.\n");
+                exit(1);
+            }
+        }
+        part->value = &mp->fields[mp->fields_len];
+    }
+
+    mp->part = part;
+    return MULTIPART_CONTINUE;
+}
+
+static enum multipart_result
+end_part(multipart_t *mp)
+{
+    enum multipart_result ret = MULTIPART_CONTINUE;
+    if (mp->fd >= 0) {
+        ret = flush_file(mp);
+        sha256_final(&mp->hash, mp->part->digest);
+        if (close(mp->fd) != 0 && ret == MULTIPART_CONTINUE) {
+            perror("end_part: close()");
+            ret = MULTIPART_IO_ERROR;
+        }
+        mp->fd = -1;
+    }
+    mp->part = NULL;
+    return ret;
+}
+
+static enum multipart_result
+feed(multipart_t *mp, const char *buf, long len)
+{
+    enum multipart_result ret;
+    long i = 0;
+
+    while (i < len) {
+        switch (mp->state) {
+            case MP_PART_DATA: {
+                if (mp->match == 0) {
+                    /* Pass everything up to the next CR through at once. */
+                    const char *cr = memchr(&buf[i], '\r', len - i);
+                    long run = cr ? cr - &buf[i] : len - i;
+                    if (run > 0) {
+                        if ((ret = emit(mp, &buf[i], run)) != MULTIPART_CONTINUE) {
+                            return ret;
+                        }
+                        i += run;
+                        continue;
+                    }
+                }
+                char c = buf[i++];
+                if (c == mp->delimiter[mp->match]) {
+                    mp->match++;
+                    if (mp->match == mp->delimiter_len) {
+                        mp->match = 0;
+                        mp->state = MP_AFTER_DELIMITER;
+                        if ((ret = end_part(mp)) != MULTIPART_CONTINUE) {
+                            return ret;
+                        }
+                    }
+                } else {
+                    /* The held back bytes were data after all. */
+                    if ((ret = emit(mp, mp->delimiter, mp->match)) != MULTIPART_CONTINUE) {
+                        return ret;
+                    }
+                    if (c == '\r') {
+                        mp->match = 1;
+                    } else {
+                        mp->match = 0;
+                        if ((ret = emit(mp, &c, 1)) != MULTIPART_CONTINUE) {
+                            return ret;
+                        }
+                    }
+                }
+            } break;
+
+            case MP_AFTER_DELIMITER: {
+                char c = buf[i++];
+                if (c == '-') {
+                    mp->state = MP_CLOSE_DASH;
+                } else if (c == '\r') {
+                    mp->state = MP_DELIMITER_LF;
+                } else if (c != ' ' && c != '\t') {
+                    return MULTIPART_INVALID;
+                }
+            } break;
+
+            case MP_CLOSE_DASH: {
+                if (buf[i++] != '-') {
+                    return MULTIPART_INVALID;
+                }
+                mp->state = MP_EPILOGUE;
+            } break;
+
+            case MP_DELIMITER_LF: {
+                if (buf[i++] != '\n') {
+                    return MULTIPART_INVALID;
+                }
+                mp->headers_len = 0;
+                mp->state = MP_PART_HEADERS;
+            } break;
+
+            case MP_PART_HEADERS: {
+                if (mp->headers_len + 1 == MULTIPART_PART_HEADERS_MAXSIZE) {
+                    fprintf(stderr, "feed: Part headers too large.\n");
+                    return MULTIPART_INVALID;
+                }
+                mp->headers[mp->headers_len++] = buf[i++];
+
+                int l = mp->headers_len;
+                char *h = mp->headers;
+                if ((l == 2 && h[0] == '\r' && h[1] == '\n') || (l >= 4 && memcmp(&h[l - 4], "\r\n\r\n", 4) == 0)) {
+                    if ((ret = begin_part(mp)) != MULTIPART_CONTINUE) {
+                        return ret;
+                    }
+                    mp->state = MP_PART_DATA;
+                }
+            } break;
+
+            case MP_EPILOGUE: {
+                i = len;
+            } break;
+
+            case MP_FAILED: {
+                return MULTIPART_INVALID;
+            } break;
+        }
+    }
+    return MULTIPART_CONTINUE;
+}
+
+/* Parses the next len bytes of the body. Returns MULTIPART_CONTINUE, or the error that stops parsing. */
+enum multipart_result
+multipart_feed(multipart_t *mp, const char *buf, long len)
+{
+    enum multipart_result ret = feed(mp, buf, len);
+    if (ret != MULTIPART_CONTINUE) {
+        mp->state = MP_FAILED;
+    }
+    return ret;
+}
+
+/* Called once the whole body was fed. */
+enum multipart_result
+multipart_finish(multipart_t *mp)
+{
+    return (mp->state == MP_EPILOGUE) ? MULTIPART_DONE : MULTIPART_INVALID;
+}
+
+int
+multipart_nparts(multipart_t *mp)
+{
+    return mp->nparts;
+}
+
+multipart_part_t *
+multipart_part(multipart_t *mp, int i)
+{
+    return &mp->parts[i];
+}
+
+/* Moves the part's temporary file to directory/filename. */
+int
+multipart_save_file(multipart_part_t *part, const char *directory, const char *filename)
+{
+    char path[256];
+    int len = snprintf(path, sizeof(path), "%s/%s", directory, filename);
+    if (len + 1 > (int)sizeof(path)) {
+        fprintf(stderr, "multipart_save_file: Path buffer too small.\n");
+        return 1;
+    }
+    if (rename(part->path, path) != 0) {
+        perror("multipart_save_file: rename()");
+        return 1;
+    }
+    part->path[0] = '\0';
+    return 0;
+}
+
+/*
+ * Removes the temporary files of uploads that never finished, left in tmp_dir
+ * when the server was killed while receiving them. Must be called before any
+ * upload is started.
+ */
+void
+multipart_remove_stale_files(const char *tmp_dir)
+{
+    DIR *dir = opendir(tmp_dir);
+    if (!dir) {
+        fprintf(stderr, "multipart_remove_stale_files: Failed to open directory %s.\n", tmp_dir);
+        exit(1);
+    }
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (strncmp(de->d_name, ".part-", 6) != 0) {
+            continue;
+        }
+        if (unlinkat(dirfd(dir), de->d_name, 0) != 0) {
+            perror("multipart_remove_stale_files: unlinkat()");
+        }
+    }
+    closedir(dir);
+}
+
+void
+multipart_free(multipart_t *mp)
+{
+    if (!mp) {
+        return;
+    }
+    if (mp->fd >= 0) {
+        close(mp->fd);
+    }
+    for (int i = 0; i < mp->nparts; i++) {
+        if (mp->parts[i].is_file && mp->parts[i].path[0]) {
+            unlink(mp->parts[i].path);
+        }
+    }
+    free(mp->fields);
+    free(mp->filebuf);
+    free(mp);
+}
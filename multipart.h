@@ -0,0 +1,40 @@
+#define MULTIPART_MAX_PARTS 8
+#define MULTIPART_NAME_MAXLEN 32
+#define MULTIPART_CONTENT_TYPE_MAXLEN 64
+#define MULTIPART_PATH_MAXLEN 128
+#define MULTIPART_FILE_HEAD_SIZE 16
+#define MULTIPART_DIGEST_SIZE 32
+
+enum multipart_result {
+    MULTIPART_CONTINUE,
+    MULTIPART_DONE,
+    MULTIPART_INVALID,
+    MULTIPART_IO_ERROR,
+};
+
+typedef struct multipart_part {
+    char name[MULTIPART_NAME_MAXLEN];
+    char content_type[MULTIPART_CONTENT_TYPE_MAXLEN]; /* Empty if the part had no Content-Type. */
+    int is_file; /* Value was written to the temporary file at path instead of memory. */
+
+    /* Text fields. */
+    char *value;
+    long value_len;
+
+    /* File parts. */
+    char path[MULTIPART_PATH_MAXLEN]; /* Removed by multipart_free() unless moved with multipart_save_file(). */
+    long size;
+    unsigned char head[MULTIPART_FILE_HEAD_SIZE]; /* First bytes of the file, for signature checks. */
+    unsigned char digest[MULTIPART_DIGEST_SIZE]; /* SHA-256 of the file, set once the part is complete. */
+} multipart_part_t;
+
+typedef struct multipart multipart_t;
+
+multipart_t *multipart_create(const char *boundary, const char *tmp_dir);
+enum multipart_result multipart_feed(multipart_t *mp, const char *buf, long len);
+enum multipart_result multipart_finish(multipart_t *mp);
+int multipart_nparts(multipart_t *mp);
+multipart_part_t *multipart_part(multipart_t *mp, int i);
+int multipart_save_file(multipart_part_t *part, const char *directory, const char *filename);
+void multipart_remove_stale_files(const char *tmp_dir);
+void multipart_free(multipart_t *mp);
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "page_cache.h"
+
+/*
+ * Rendered pages and fragments of pages, each kept in a slot owned by what it
+ * was rendered from, up to PAGE_CACHE_BUDGET bytes. Entries that don't fit
+ * are used once and not cached. A slot holds one reference to its entry and
+ * responses hold one each, so an entry that is invalidated while being sent
+ * is freed when the last response using it is done.
+ */
+static long cached_bytes;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long
+entry_size(page_cache_entry_t *entry)
+{
+    return sizeof(page_cache_entry_t) + entry->body_size;
+}
+
+/* Returns a new entry that takes ownership of body, with one reference held by the caller. */
+page_cache_entry_t *
+page_cache_new_entry(char *body, long body_size)
+{
+    page_cache_entry_t *entry = calloc(1, sizeof(page_cache_entry_t));
+    if (!entry) {
+        fprintf(stderr, "page_cache_new_entry: calloc() failed.\n");
+        exit(1);
+    }
+    entry->body = body;
+    entry->body_size = body_size;
+    entry->refcount = 1;
+    return entry;
+}
+
+/* Returns the entry in slot with a reference held, which must be dropped with page_cache_release(). NULL if the slot is empty. */
+page_cache_entry_t *
+page_cache_get(page_cache_entry_t **slot)
+{
+    pthread_mutex_lock(&cache_lock);
+    page_cache_entry_t *entry = *slot;
+    if (entry) {
+        entry->refcount++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+}
+
+/* Stores entry in slot unless the slot was filled meanwhile or the budget is used up. The caller keeps its reference. */
+void
+page_cache_put(page_cache_entry_t **slot, page_cache_entry_t *entry)
+{
+    pthread_mutex_lock(&cache_lock);
+    long size = entry_size(entry);
+    if (!*slot && cached_bytes + size <= PAGE_CACHE_BUDGET) {
+        *slot = entry;
+        entry->refcount++;
+        cached_bytes += size;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Empties the slot, called when what the fragment was rendered from changes. */
+void
+page_cache_invalidate(page_cache_entry_t **slot)
+{
+    pthread_mutex_lock(&cache_lock);
+    page_cache_entry_t *entry = *slot;
+    *slot = NULL;
+    if (entry) {
+        cached_bytes -= entry_size(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (entry) {
+        page_cache_release(entry);
+    }
+}
+
+void
+page_cache_release(page_cache_entry_t *entry)
+{
+    pthread_mutex_lock(&cache_lock);
+    int unused = --entry->refcount == 0;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (unused) {
+        free(entry->body);
+        free(entry);
+    }
+}
@@ -0,0 +1,13 @@
+/* A rendered page or fragment of one. */
+typedef struct page_cache_entry {
+    char *body;
+    long body_size;
+
+    int refcount;
+} page_cache_entry_t;
+
+page_cache_entry_t *page_cache_new_entry(char *body, long body_size);
+page_cache_entry_t *page_cache_get(page_cache_entry_t **slot);
+void page_cache_put(page_cache_entry_t **slot, page_cache_entry_t *entry);
+void page_cache_invalidate(page_cache_entry_t **slot);
+void page_cache_release(page_cache_entry_t *entry);
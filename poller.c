@@ -0,0 +1,325 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "poller.h"
+
+#define POLLER_RESIZE_INC 128
+
+/*
+ * The poll backend keeps its pollfd array dense: removing an fd moves the last
+ * entry into the freed position, so poll() is only ever given active fds.
+ * fd_index maps an fd back to its position in the array.
+ *
+ * The epoll backend lets the kernel track the interest list and only returns
+ * ready fds, so the cost of a wakeup doesn't depend on the number of idle
+ * connections.
+ */
+struct poller {
+    enum poller_backend backend;
+
+    /* poll */
+    struct pollfd *fds;
+    long *tokens;
+    int nfds;
+    int fds_allocated;
+    int *fd_index;
+    int fd_index_allocated;
+
+    /* epoll */
+    int epfd;
+    struct epoll_event *epevents;
+    int epevents_allocated;
+};
+
+int
+poller_backend_from_string(const char *str, enum poller_backend *backend)
+{
+    if (strcmp(str, "poll") == 0) {
+        *backend = POLLER_BACKEND_POLL;
+    } else if (strcmp(str, "epoll") == 0) {
+        *backend = POLLER_BACKEND_EPOLL;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+const char *
+poller_backend_name(enum poller_backend backend)
+{
+    switch (backend) {
+        case POLLER_BACKEND_POLL: return "poll";
+        case POLLER_BACKEND_EPOLL: return "epoll";
+    }
+    return "unknown";
+}
+
+static short
+to_poll_events(unsigned int events)
+{
+    short e = 0;
+    if (events & POLLER_IN)
+        e |= POLLIN;
+    if (events & POLLER_OUT)
+        e |= POLLOUT;
+    return e;
+}
+
+static unsigned int
+from_poll_events(short revents)
+{
+    unsigned int e = 0;
+    if (revents & POLLIN)
+        e |= POLLER_IN;
+    if (revents & POLLOUT)
+        e |= POLLER_OUT;
+    if (revents & (POLLERR | POLLHUP | POLLNVAL))
+        e |= POLLER_ERR;
+    return e;
+}
+
+static uint32_t
+to_epoll_events(unsigned int events)
+{
+    uint32_t e = 0;
+    if (events & POLLER_IN)
+        e |= EPOLLIN;
+    if (events & POLLER_OUT)
+        e |= EPOLLOUT;
+    return e;
+}
+
+static unsigned int
+from_epoll_events(uint32_t revents)
+{
+    unsigned int e = 0;
+    if (revents & EPOLLIN)
+        e |= POLLER_IN;
+    if (revents & EPOLLOUT)
+        e |= POLLER_OUT;
+    if (revents & (EPOLLERR | EPOLLHUP))
+        e |= POLLER_ERR;
+    return e;
+}
+
+poller_t *
+poller_create(enum poller_backend backend)
+{
+    poller_t *p = calloc(1, sizeof(poller_t));
+    if (!p) {
+        fprintf(stderr, "poller_create: calloc() failed.\n");
+        exit(1);
+    }
+    p->backend = backend;
+    p->epfd = -1;
+
+    if (backend == POLLER_BACKEND_EPOLL) {
+        p->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (p->epfd < 0) {
+            perror("poller_create: epoll_create1()");
+            exit(1);
+        }
+    }
+
+    return p;
+}
+
+static void
+poll_fd_index_reserve(poller_t *p, int fd)
+{
+    if (fd < p->fd_index_allocated) {
+        return;
+    }
+    int newsize = p->fd_index_allocated;
+    while (newsize <= fd) {
+        newsize += POLLER_RESIZE_INC;
+    }
+    int *tmp = realloc(p->fd_index, newsize * sizeof(int));
+    if (!tmp) {
+        fprintf(stderr, "poll_fd_index_reserve: realloc() failed.\n");
+        exit(1);
+    }
+    for (int i = p->fd_index_allocated; i < newsize; i++) {
+        tmp[i] = -1;
+    }
+    p->fd_index = tmp;
+    p->fd_index_allocated = newsize;
+}
+
+static void
+poll_add(poller_t *p, int fd, unsigned int events, long token)
+{
+    poll_fd_index_reserve(p, fd);
+    if (p->fd_index[fd] >= 0) {
+        fprintf(stderr, "poll_add: fd %d already registered.\n", fd);
+        exit(1);
+    }
+
+    if (p->nfds + 1 > p->fds_allocated) {
+        int newsize = p->fds_allocated + POLLER_RESIZE_INC;
+        struct pollfd *tmp_fds = realloc(p->fds, newsize * sizeof(struct pollfd));
+        if (!tmp_fds) {
+            fprintf(stderr, "poll_add: realloc() failed.\n");
+            exit(1);
+        }
+        p->fds = tmp_fds;
+        long *tmp_tokens = realloc(p->tokens, newsize * sizeof(long));
+        if (!tmp_tokens) {
+            fprintf(stderr, "poll_add: realloc() failed.\n");
+            exit(1);
+        }
+        p->tokens = tmp_tokens;
+        p->fds_allocated = newsize;
+    }
+
+    int i = p->nfds++;
+    p->fds[i].fd = fd;
+    p->fds[i].events = to_poll_events(events);
+    p->fds[i].revents = 0;
+    p->tokens[i] = token;
+    p->fd_index[fd] = i;
+}
+
+static void
+poll_mod(poller_t *p, int fd, unsigned int events, long token)
+{
+    if (fd >= p->fd_index_allocated || p->fd_index[fd] < 0) {
+        fprintf(stderr, "poll_mod: fd %d not registered.\n", fd);
+        exit(1);
+    }
+    int i = p->fd_index[fd];
+    p->fds[i].events = to_poll_events(events);
+    p->tokens[i] = token;
+}
+
+static void
+poll_del(poller_t *p, int fd)
+{
+    if (fd >= p->fd_index_allocated || p->fd_index[fd] < 0) {
+        fprintf(stderr, "poll_del: fd %d not registered.\n", fd);
+        exit(1);
+    }
+    int i = p->fd_index[fd];
+    int last = p->nfds - 1;
+    if (i != last) {
+        p->fds[i] = p->fds[last];
+        p->tokens[i] = p->tokens[last];
+        p->fd_index[p->fds[i].fd] = i;
+    }
+    p->fd_index[fd] = -1;
+    p->nfds--;
+}
+
+static int
+poll_wait(poller_t *p, poller_event_t *events, int maxevents, int timeout)
+{
+    int nready = poll(p->fds, p->nfds, timeout);
+    if (nready < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll_wait: poll()");
+        exit(1);
+    }
+
+    int nevents = 0;
+    for (int i = 0; i < p->nfds && nready > 0 && nevents < maxevents; i++) {
+        if (p->fds[i].revents == 0) {
+            continue;
+        }
+        nready--;
+        events[nevents].token = p->tokens[i];
+        events[nevents].events = from_poll_events(p->fds[i].revents);
+        nevents++;
+    }
+    return nevents;
+}
+
+static void
+epoll_ctl_or_die(poller_t *p, int op, int fd, unsigned int events, long token)
+{
+    struct epoll_event ev = {0};
+    ev.events = to_epoll_events(events);
+    ev.data.u64 = (uint64_t)token;
+    if (epoll_ctl(p->epfd, op, fd, &ev) != 0) {
+        perror("epoll_ctl_or_die: epoll_ctl()");
+        exit(1);
+    }
+}
+
+static int
+epoll_wait_events(poller_t *p, poller_event_t *events, int maxevents, int timeout)
+{
+    if (maxevents > p->epevents_allocated) {
+        struct epoll_event *tmp = realloc(p->epevents, maxevents * sizeof(struct epoll_event));
+        if (!tmp) {
+            fprintf(stderr, "epoll_wait_events: realloc() failed.\n");
+            exit(1);
+        }
+        p->epevents = tmp;
+        p->epevents_allocated = maxevents;
+    }
+
+    int nready = epoll_wait(p->epfd, p->epevents, maxevents, timeout);
+    if (nready < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait_events: epoll_wait()");
+        exit(1);
+    }
+
+    for (int i = 0; i < nready; i++) {
+        events[i].token = (long)p->epevents[i].data.u64;
+        events[i].events = from_epoll_events(p->epevents[i].events);
+    }
+    return nready;
+}
+
+void
+poller_add(poller_t *p, int fd, unsigned int events, long token)
+{
+    if (p->backend == POLLER_BACKEND_EPOLL) {
+        epoll_ctl_or_die(p, EPOLL_CTL_ADD, fd, events, token);
+    } else {
+        poll_add(p, fd, events, token);
+    }
+}
+
+void
+poller_mod(poller_t *p, int fd, unsigned int events, long token)
+{
+    if (p->backend == POLLER_BACKEND_EPOLL) {
+        epoll_ctl_or_die(p, EPOLL_CTL_MOD, fd, events, token);
+    } else {
+        poll_mod(p, fd, events, token);
+    }
+}
+
+void
+poller_del(poller_t *p, int fd)
+{
+    if (p->backend == POLLER_BACKEND_EPOLL) {
+        epoll_ctl_or_die(p, EPOLL_CTL_DEL, fd, 0, 0);
+    } else {
+        poll_del(p, fd);
+    }
+}
+
+/* Returns the number of events written to events, 0 on timeout or signal. */
+int
+poller_wait(poller_t *p, poller_event_t *events, int maxevents, int timeout)
+{
+    if (p->backend == POLLER_BACKEND_EPOLL) {
+        return epoll_wait_events(p, events, maxevents, timeout);
+    } else {
+        return poll_wait(p, events, maxevents, timeout);
+    }
+}
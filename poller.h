@@ -0,0 +1,26 @@
+enum poller_backend {
+    POLLER_BACKEND_POLL,
+    POLLER_BACKEND_EPOLL,
+};
+
+enum poller_event_flags {
+    POLLER_IN  = 1 << 0,
+    POLLER_OUT = 1 << 1,
+    POLLER_ERR = 1 << 2, /* Error, hangup or invalid fd. Always reported, never requested. */
+};
+
+typedef struct {
+    long token;
+    unsigned int events;
+} poller_event_t;
+
+typedef struct poller poller_t;
+
+int poller_backend_from_string(const char *str, enum poller_backend *backend);
+const char *poller_backend_name(enum poller_backend backend);
+
+poller_t *poller_create(enum poller_backend backend);
+void poller_add(poller_t *p, int fd, unsigned int events, long token);
+void poller_mod(poller_t *p, int fd, unsigned int events, long token);
+void poller_del(poller_t *p, int fd);
+int poller_wait(poller_t *p, poller_event_t *events, int maxevents, int timeout);
@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "forum.h"
+#include "upload_index.h"
+#include "reclaimer.h"
+
+/*
+ * Background thread that finishes deletions: deleting a thread or evicting
+ * the oldest one only unlinks it and marks its files, the reclaimer frees the
+ * posts, moves the files to the deleted directory in batches and removes
+ * deleted files once they're past the retention period.
+ */
+static void *
+reclaimer_main(void *arg)
+{
+    struct timespec interval = {
+        .tv_sec = RECLAIM_INTERVAL_MS / 1000,
+        .tv_nsec = (RECLAIM_INTERVAL_MS % 1000) * 1000000L,
+    };
+    time_t last_purge = 0;
+
+    while (1) {
+        nanosleep(&interval, NULL);
+
+        long nthreads = forum_reclaim();
+
+        /* The index lock is released between batches, so requests aren't held up by a large backlog. */
+        long nmoved = 0;
+        long pending;
+        long n;
+        do {
+            n = upload_index_reclaim(RECLAIM_BATCH_SIZE, &pending);
+            nmoved += n;
+        } while (n > 0 && pending > 0);
+
+        long npurged = 0;
+        time_t now = time(NULL);
+        if (now - last_purge >= DELETED_PURGE_INTERVAL_SECONDS) {
+            npurged = upload_index_purge_deleted(DELETED_RETENTION_SECONDS);
+            last_purge = now;
+        }
+
+        if (nthreads > 0 || nmoved > 0 || npurged > 0 || pending > 0) {
+            fprintf(stderr, "reclaimer: Freed %ld threads, moved %ld files (%ld pending), purged %ld deleted files.\n", nthreads, nmoved, pending, npurged);
+        }
+    }
+    return arg;
+}
+
+void
+reclaimer_start(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reclaimer_main, NULL) != 0) {
+        fprintf(stderr, "reclaimer_start: pthread_create() failed.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1 @@
+void reclaimer_start(void);
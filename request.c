@@ -11,6 +11,38 @@
 static const char headers_end_str[] = "\r\n\r\n";
 static const char headers_line_delim[] = "\r\n";
 static const char multipart_formdata_str[] = "multipart/form-data";
+static const char http_1_1_str[] = "HTTP/1.1";
+
+/*
+ * Scans buf from scanpos up to bufpos for the end of the headers section.
+ * headers_end_state carries partial matches of the terminator between calls.
+ */
+enum read_headers_result
+find_headers_end(int *headers_end_state, char *buf, long scanpos, long bufpos, long bufs, long *headers_len, long *rem_len)
+{
+    for (long i = scanpos; i < bufpos; i++) {
+        char c = buf[i];
+        if (c != '\r' && c != '\n' && c != ' ' && !isalnum(c) && !ispunct(c)) {
+            fprintf(stderr, "find_headers_end: Illegal character in headers.\n");
+            return READ_HEADERS_FAILED_SEND_400;
+        }
+        if (c == headers_end_str[*headers_end_state]) {
+            (*headers_end_state)++;
+        } else {
+            *headers_end_state = 0;
+        }
+        if (*headers_end_state == sizeof(headers_end_str) - 1) {
+            *headers_len = i + 1;
+            *rem_len = bufpos - *headers_len;
+            return READ_HEADERS_DONE;
+        }
+    }
+    if (bufpos == bufs) {
+        fprintf(stderr, "find_headers_end: Headers section too large.\n");
+        return READ_HEADERS_FAILED_SEND_400;
+    }
+    return READ_HEADERS_CONTINUE;
+}
 
 enum read_headers_result
 read_headers(int sock, int *headers_end_state, char *buf, long *bufpos, long bufs, long *headers_len, long *rem_len)
@@ -32,34 +64,9 @@ read_headers(int sock, int *headers_end_state, char *buf, long *bufpos, long buf
         return READ_HEADERS_FAILED_SEND_400;
     }
 
-    int headers_end_found = 0;
-    for (long i = *bufpos; i < *bufpos + nread; i++) {
-        char c = buf[i];
-        if (c != '\r' && c != '\n' && c != ' ' && !isalnum(c) && !ispunct(c)) {
-            fprintf(stderr, "read_headers: Illegal character in headers.\n");
-            return READ_HEADERS_FAILED_SEND_400;
-        }
-        if (c == headers_end_str[*headers_end_state]) {
-            (*headers_end_state)++;
-        } else {
-            *headers_end_state = 0;
-        }
-        if (*headers_end_state == sizeof(headers_end_str) - 1) {
-            headers_end_found = 1;
-            *headers_len = i + 1;
-            break;
-        }
-    }
+    long scanpos = *bufpos;
     *bufpos += nread;
-    if (headers_end_found) {
-        *rem_len = *bufpos - *headers_len;
-        return READ_HEADERS_DONE;
-    }
-    if (*bufpos == bufs) {
-        fprintf(stderr, "read_headers: Headers section too large.\n");
-        return READ_HEADERS_FAILED_SEND_400;
-    }
-    return READ_HEADERS_CONTINUE;
+    return find_headers_end(headers_end_state, buf, scanpos, *bufpos, bufs, headers_len, rem_len);
 }
 
 static void
@@ -108,10 +115,36 @@ parse_content_type(char *value, char **mime_type, char **boundary)
     *boundary = equals + 1;
 }
 
+/* Connection field value is a comma separated list of case-insensitive tokens. */
+static void
+parse_connection_field(char *value, int *close_found, int *keep_alive_found)
+{
+    string_to_lowercase(value);
+    char *tok = value;
+    while (*tok) {
+        while (*tok == ' ' || *tok == ',')
+            tok++;
+        char *end = tok;
+        while (*end && *end != ' ' && *end != ',')
+            end++;
+        int len = end - tok;
+        if (len == sizeof("close") - 1 && strncmp(tok, "close", len) == 0) {
+            *close_found = 1;
+        } else if (len == sizeof("keep-alive") - 1 && strncmp(tok, "keep-alive", len) == 0) {
+            *keep_alive_found = 1;
+        }
+        tok = end;
+    }
+}
+
 int
 parse_headers(request_t *req, char *buf, long bufs)
 {
     req->ct = RCT_NONE;
+    req->http_minor = 0;
+    req->keep_alive = 0;
+    int connection_close = 0;
+    int connection_keep_alive = 0;
 
     if (bufs < (int)sizeof("GET / HTTP\r\n\r\n") - 1) {
         /* Consider "GET / HTTP\r\n\r\n" as the minimal valid request. */
@@ -163,6 +196,10 @@ parse_headers(request_t *req, char *buf, long bufs)
             *s2 = '\0';
             parse_route(cur_line, &req->path, &req->params);
 
+            if (strcmp(s2 + 1, http_1_1_str) == 0) {
+                req->http_minor = 1;
+            }
+
         } else {
 
             /* HTTP request header field format: */
@@ -235,6 +272,10 @@ parse_headers(request_t *req, char *buf, long bufs)
                     return 1;
                 }
 
+            } else if (strcmp(field_name, "connection") == 0) {
+
+                parse_connection_field(field_value, &connection_close, &connection_keep_alive);
+
             }
 
         }
@@ -252,5 +293,16 @@ parse_headers(request_t *req, char *buf, long bufs)
         return 1;
     }
 
+    /* HTTP/1.1 connections are persistent unless closed explicitly, HTTP/1.0 ones only on request. */
+    if (req->http_minor >= 1) {
+        req->keep_alive = !connection_close;
+    } else {
+        req->keep_alive = connection_keep_alive && !connection_close;
+    }
+    if (req->meth != RM_POST && req->content_length > 0) {
+        /* A body we don't read would be taken for the next request. */
+        req->keep_alive = 0;
+    }
+
     return 0;
 }
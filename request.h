@@ -9,6 +9,8 @@ enum request_content_type {
     RCT_MULTIPART_FORMDATA,
 };
 
+struct multipart;
+
 typedef struct {
     enum request_method meth;
     char *path;
@@ -16,8 +18,10 @@ typedef struct {
     enum request_content_type ct;
     long content_length;
     char boundary[73];
-    char *body_buf;
-    long body_bufpos;
+    struct multipart *form; /* Parser of a multipart/form-data body, set while the body is received and routed. */
+    long body_bufpos; /* Bytes of the body received so far. */
+    int http_minor; /* 0 for HTTP/1.0 (and anything unrecognized), 1 for HTTP/1.1. */
+    int keep_alive; /* Client allows the connection to be reused, from the version and the Connection field. */
 } request_t;
 
 enum read_headers_result {
@@ -27,5 +31,6 @@ enum read_headers_result {
     READ_HEADERS_FAILED_SEND_400,
 };
 
+enum read_headers_result find_headers_end(int *headers_end_state, char *buf, long scanpos, long bufpos, long bufs, long *headers_len, long *rem_len);
 enum read_headers_result read_headers(int sock, int *headers_end_state, char *buf, long *bufpos, long bufs, long *headers_len, long *rem_len);
 int parse_headers(request_t *req, char *buf, long bufs);
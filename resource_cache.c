@@ -1,61 +1,322 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 
 #include "utils.h"
+#include "assets.h"
 #include "resource_cache.h"
 
-#define RESOURCE_CACHE_SIZE 100
-#define MAX_FILENAME_LENGTH 100
+#define RESOURCE_CACHE_INITIAL_BUCKETS 64
+#define RESOURCE_CACHE_MAX_WATCHES 16
+
+/*
+ * Pages and templates, embedded into the binary by build.sh unless use_disk
+ * is set, in which case they're read from the working directory.
+ *
+ * Files loaded once and kept for the life of the process, in a hash table
+ * that doubles its buckets when it gets full. Entries are allocated one by
+ * one and never removed, so handles stay valid and callers that resolve their
+ * files up front don't look them up again.
+ *
+ * When a watched file changes, its new contents are loaded and swapped in.
+ * Readers hold a reference to the contents they use, so responses still
+ * sending the old version keep it alive until they're done.
+ */
+static resource_t **buckets;
+static long nbuckets;
+static long nentries;
+static int use_disk;
+static void (*reload_callback)(void);
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t contents_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards every handle's contents pointer and the reference counts. */
 
 typedef struct {
-    char filename[MAX_FILENAME_LENGTH];
-    char *buf;
-    long bufs;
-} resource_cache_entry_t;
+    int wd;
+    char *dir;
+} watch_t;
 
-static resource_cache_entry_t cache[RESOURCE_CACHE_SIZE];
-static int resource_cache_pos = 0;
+static watch_t watches[RESOURCE_CACHE_MAX_WATCHES];
+static int nwatches;
 
-void
-resource_cache_get_file_buffer(const char *filename, char **f, long *fs)
+static unsigned long
+hash_filename(const char *filename)
 {
-    for (int i = 0; i < resource_cache_pos; i++) {
-        if (strcmp(cache[i].filename, filename) == 0) {
-            *f = cache[i].buf;
-            if (fs) {
-                *fs = cache[i].bufs;
-            }
-            return;
+    unsigned long h = 5381;
+    while (*filename) {
+        h = h * 33 + (unsigned char)*filename++;
+    }
+    return h;
+}
+
+static void
+grow_table(void)
+{
+    long newsize = (nbuckets > 0) ? nbuckets * 2 : RESOURCE_CACHE_INITIAL_BUCKETS;
+    resource_t **tmp = calloc(newsize, sizeof(resource_t *));
+    if (!tmp) {
+        fprintf(stderr, "grow_table: calloc() failed.\n");
+        exit(1);
+    }
+    for (long i = 0; i < nbuckets; i++) {
+        resource_t *r = buckets[i];
+        while (r) {
+            resource_t *next = r->next;
+            unsigned long h = hash_filename(r->filename) % newsize;
+            r->next = tmp[h];
+            tmp[h] = r;
+            r = next;
         }
     }
+    free(buckets);
+    buckets = tmp;
+    nbuckets = newsize;
+}
 
-    int len = strlen(filename);
-    if (len + 1 > MAX_FILENAME_LENGTH) {
-        fprintf(stderr, "resource_cache_get_file_buffer: Filename too long.\n");
+/* Must be called with cache_lock held. */
+static resource_t *
+lookup(const char *filename)
+{
+    if (nbuckets == 0) {
+        return NULL;
+    }
+    for (resource_t *r = buckets[hash_filename(filename) % nbuckets]; r; r = r->next) {
+        if (strcmp(r->filename, filename) == 0) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Returns NULL if the file can't be read. The caller holds the only reference. */
+static resource_contents_t *
+load_contents(const char *filename)
+{
+    resource_contents_t *c = malloc(sizeof(resource_contents_t));
+    if (!c) {
+        fprintf(stderr, "load_contents: malloc() failed.\n");
         exit(1);
     }
+    c->refs = 1;
+    c->embedded = !use_disk;
 
-    if (resource_cache_pos == RESOURCE_CACHE_SIZE) {
-        fprintf(stderr, "resource_cache_get_file_buffer: Ran out of cache space.\n");
+    if (use_disk) {
+        if (load_file_to_new_buffer(filename, &c->buf, &c->bufs) != 0) {
+            free(c);
+            return NULL;
+        }
+        return c;
+    }
+    for (int i = 0; i < nassets; i++) {
+        if (strcmp(assets[i].filename, filename) == 0) {
+            c->buf = (char *)assets[i].buf;
+            c->bufs = assets[i].bufs;
+            return c;
+        }
+    }
+    fprintf(stderr, "load_contents: No embedded file %s.\n", filename);
+    free(c);
+    return NULL;
+}
+
+/* Reads files from the working directory instead of the embedded copies. Must be called before the first file is resolved. */
+void
+resource_cache_use_disk(void)
+{
+    use_disk = 1;
+}
+
+/* Returns the handle of filename, loading the file on first use. Returns NULL if the file can't be loaded. */
+resource_t *
+resource_cache_try_resolve(const char *filename)
+{
+    pthread_mutex_lock(&cache_lock);
+    resource_t *r = lookup(filename);
+    if (r) {
+        pthread_mutex_unlock(&cache_lock);
+        return r;
+    }
+
+    resource_contents_t *contents = load_contents(filename);
+    if (!contents) {
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+
+    if (nentries + 1 > nbuckets) {
+        grow_table();
+    }
+
+    r = malloc(sizeof(resource_t));
+    if (!r) {
+        fprintf(stderr, "resource_cache_try_resolve: malloc() failed.\n");
         exit(1);
     }
+    r->contents = contents;
+    r->filename = copy_string(filename);
+    unsigned long h = hash_filename(filename) % nbuckets;
+    r->next = buckets[h];
+    buckets[h] = r;
+    nentries++;
+    pthread_mutex_unlock(&cache_lock);
+    return r;
+}
 
-    char *buf;
-    long bufs;
-    int ret = load_file_to_new_buffer(filename, &buf, &bufs);
-    if (ret != 0) {
+/* Like resource_cache_try_resolve(), for files the server can't run without. */
+resource_t *
+resource_cache_resolve(const char *filename)
+{
+    resource_t *r = resource_cache_try_resolve(filename);
+    if (!r) {
         exit(1);
     }
+    return r;
+}
+
+/* Returns the current contents of r, which stay valid until released with resource_release(). */
+resource_contents_t *
+resource_acquire(resource_t *r)
+{
+    pthread_mutex_lock(&contents_lock);
+    resource_contents_t *c = r->contents;
+    c->refs++;
+    pthread_mutex_unlock(&contents_lock);
+    return c;
+}
+
+void
+resource_release(resource_contents_t *c)
+{
+    pthread_mutex_lock(&contents_lock);
+    int unused = --c->refs == 0;
+    pthread_mutex_unlock(&contents_lock);
+
+    if (unused) {
+        if (!c->embedded) {
+            free(c->buf);
+        }
+        free(c);
+    }
+}
 
-    resource_cache_entry_t *entry = &cache[resource_cache_pos];
-    memcpy(entry->filename, filename, len + 1);
-    entry->buf = buf;
-    entry->bufs = bufs;
-    resource_cache_pos++;
+static int
+reload(resource_t *r)
+{
+    resource_contents_t *c = load_contents(r->filename);
+    if (!c) {
+        fprintf(stderr, "reload: Keeping the old version of %s.\n", r->filename);
+        return 0;
+    }
+    pthread_mutex_lock(&contents_lock);
+    resource_contents_t *old = r->contents;
+    r->contents = c;
+    pthread_mutex_unlock(&contents_lock);
+    resource_release(old);
+    fprintf(stderr, "Reloaded %s.\n", r->filename);
+    return 1;
+}
+
+/* Sets a function to call after files were reloaded, to rebuild anything made from their old contents. */
+void
+resource_cache_on_reload(void (*fn)(void))
+{
+    reload_callback = fn;
+}
+
+/*
+ * Starts watching the directories of the files cached so far. Files are
+ * watched through their directories, since editors often replace a file
+ * instead of writing to it. Returns the inotify fd to poll, -1 on failure.
+ */
+int
+resource_cache_watch(void)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("resource_cache_watch: inotify_init1()");
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (long i = 0; i < nbuckets; i++) {
+        for (resource_t *r = buckets[i]; r; r = r->next) {
+            const char *slash = strrchr(r->filename, '/');
+            char *dir = slash ? strndup(r->filename, slash - r->filename) : copy_string(".");
+            if (!dir) {
+                fprintf(stderr, "resource_cache_watch: strndup() failed.\n");
+                exit(1);
+            }
+            int j;
+            for (j = 0; j < nwatches && strcmp(watches[j].dir, dir) != 0; j++);
+            if (j < nwatches) {
+                free(dir);
+                continue;
+            }
+            if (nwatches == RESOURCE_CACHE_MAX_WATCHES) {
+                fprintf(stderr, "resource_cache_watch: Too many directories, not watching %s.\n", dir);
+                free(dir);
+                continue;
+            }
+            int wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd < 0) {
+                perror("resource_cache_watch: inotify_add_watch()");
+                free(dir);
+                continue;
+            }
+            watches[nwatches].wd = wd;
+            watches[nwatches].dir = dir;
+            nwatches++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return fd;
+}
+
+/* Called when the inotify fd is readable, reloads the cached files that changed. */
+void
+resource_cache_handle_watch_events(int fd)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int reloaded = 0;
+    while (1) {
+        long len = read(fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN) {
+                perror("resource_cache_handle_watch_events: read()");
+            }
+            break;
+        }
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->len == 0) {
+                continue;
+            }
+            for (int i = 0; i < nwatches; i++) {
+                if (watches[i].wd != ev->wd) {
+                    continue;
+                }
+                char path[256];
+                int n = snprintf(path, sizeof(path), "%s/%s", watches[i].dir, ev->name);
+                if (n + 1 > (int)sizeof(path)) {
+                    break;
+                }
+                pthread_mutex_lock(&cache_lock);
+                resource_t *r = lookup(path);
+                pthread_mutex_unlock(&cache_lock);
+                if (r && reload(r)) {
+                    reloaded = 1;
+                }
+                break;
+            }
+        }
+    }
 
-    *f = buf;
-    if (fs) {
-        *fs = bufs;
+    if (reloaded && reload_callback) {
+        reload_callback();
     }
 }
@@ -1 +1,24 @@
-void resource_cache_get_file_buffer(const char *filename, char **buf, long *bufs);
+/* One version of a cached file. Never modified, freed when the last reference is released. */
+typedef struct {
+    char *buf;
+    long bufs;
+    int refs;
+    int embedded; /* buf points to an asset embedded in the binary and isn't freed. */
+} resource_contents_t;
+
+/* Handle to a cached file, valid for the life of the process. Its contents are replaced when the file changes. */
+typedef struct resource {
+    char *filename;
+    resource_contents_t *contents;
+    struct resource *next;
+} resource_t;
+
+void resource_cache_use_disk(void);
+resource_t *resource_cache_try_resolve(const char *filename);
+resource_t *resource_cache_resolve(const char *filename);
+resource_contents_t *resource_acquire(resource_t *r);
+void resource_release(resource_contents_t *c);
+
+void resource_cache_on_reload(void (*fn)(void));
+int resource_cache_watch(void);
+void resource_cache_handle_watch_events(int fd);
@@ -1,21 +1,43 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 
 #include "response.h"
 #include "resource_cache.h"
+#include "upload_cache.h"
+#include "config.h"
+
+static resource_t *error_400_page;
+static resource_t *error_404_page;
+static resource_t *error_500_page;
+
+/* Loads the error pages, so serving them doesn't involve a lookup. */
+void
+response_init(void)
+{
+    error_400_page = resource_cache_resolve("html/400.html");
+    error_404_page = resource_cache_resolve("html/404.html");
+    error_500_page = resource_cache_resolve("html/500.html");
+}
 
 static void
 response_add_status_line(char *buf, long *bufpos, const int code)
 {
-    const char protocol[] = "HTTP/1.0";
+    const char protocol[] = "HTTP/1.1";
     const char c200str[] = "200 OK";
     const char c303str[] = "303 SEE OTHER";
     const char c400str[] = "400 BAD REQUEST";
     const char c404str[] = "404 NOT FOUND";
     const char c500str[] = "500 INTERNAL SERVER ERROR";
+    const char c503str[] = "503 SERVICE UNAVAILABLE";
     const char endline[] = "\r\n";
     int l;
 
@@ -51,6 +73,11 @@ response_add_status_line(char *buf, long *bufpos, const int code)
             memcpy(&buf[*bufpos], c500str, l);
             *bufpos += l;
         } break;
+        case 503: {
+            l = sizeof(c503str) - 1;
+            memcpy(&buf[*bufpos], c503str, l);
+            *bufpos += l;
+        } break;
         default: {
             fprintf(stderr, "response_add_status_line: Invalid code.\n");
             exit(1);
@@ -147,71 +174,217 @@ response_add_header_end(char *buf, long *bufpos)
     *bufpos += l;
 }
 
+static send_segment_t *
+segment_at(handler_args_send_segments_t *a, int i)
+{
+    if (i < HANDLER_INLINE_SEGMENTS) {
+        return &a->segs[i];
+    }
+    return &a->more_segs[i - HANDLER_INLINE_SEGMENTS];
+}
+
+/* Fills iov with the unsent parts of the segments, starting at the first one that isn't fully sent. */
 static int
-handler_send_buffer(int sock, handler_args_t *args)
+handler_pending_send_segments(handler_args_t *args, struct iovec *iov, int maxiov)
+{
+    handler_args_send_segments_t *a = &args->send_segments;
+    long pos = a->segpos;
+    int n = 0;
+
+    for (int i = a->seg; i < a->nsegs && n < maxiov; i++) {
+        send_segment_t *seg = segment_at(a, i);
+        if (seg->bufs > pos) {
+            iov[n].iov_base = &seg->buf[pos];
+            iov[n].iov_len = seg->bufs - pos;
+            n++;
+        }
+        pos = 0;
+    }
+    return n;
+}
+
+/* Consumes n sent bytes, which may end anywhere inside any of the pending segments. */
+static void
+handler_advance_send_segments(handler_args_t *args, long n)
 {
-    handler_args_send_buffer_t *a = &args->send_buffer;
+    handler_args_send_segments_t *a = &args->send_segments;
 
-    if (a->headers_bufpos < a->headers_bufs) {
-        long nwritten = write(sock, a->headers_buf, a->headers_bufs - a->headers_bufpos);
+    while (a->seg < a->nsegs) {
+        long l = segment_at(a, a->seg)->bufs - a->segpos;
+        if (l > n) {
+            a->segpos += n;
+            return;
+        }
+        n -= l;
+        a->seg++;
+        a->segpos = 0;
+    }
+}
+
+static int
+handler_send_segments(int sock, handler_args_t *args)
+{
+    struct iovec iov[HANDLER_MAX_IOV];
+
+    while (1) {
+        int n = handler_pending_send_segments(args, iov, HANDLER_MAX_IOV);
+        if (n <= 0) {
+            return 0;
+        }
+        long len = 0;
+        for (int i = 0; i < n; i++) {
+            len += iov[i].iov_len;
+        }
+
+        long nwritten = writev(sock, iov, n);
         if (nwritten < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return 1;
             }
 
-            fprintf(stderr, "handler_send_buffer: Failed write.\n");
+            fprintf(stderr, "handler_send_segments: Failed write.\n");
             return -1;
         }
+        handler_advance_send_segments(args, nwritten);
 
-        a->headers_bufpos += nwritten;
-        if (a->headers_bufpos == a->headers_bufs && !a->body_buf) {
-            return 0;
+        if (nwritten < len) {
+            /* Socket buffer is full, wait until it's writable again. */
+            return 1;
+        }
+    }
+}
+
+static void
+handler_after_send_segments(handler_args_t *args)
+{
+    handler_args_send_segments_t *a = &args->send_segments;
+    for (int i = 0; i < a->nsegs; i++) {
+        send_segment_t *seg = segment_at(a, i);
+        if (seg->buf && seg->free_buf) {
+            free(seg->buf);
         }
     }
+    free(a->more_segs);
+    if (a->release) {
+        a->release(a->release_arg);
+    }
+}
+
+static void
+handler_init_send_segments(handler_t *h)
+{
+    h->handler = handler_send_segments;
+    h->handler_after = handler_after_send_segments;
+    h->handler_pending = handler_pending_send_segments;
+    h->handler_advance = handler_advance_send_segments;
+    memset(&h->args.send_segments, 0, sizeof(handler_args_send_segments_t));
+    h->resp_size = 0;
+}
+
+/* Appends a segment to the response, it is freed after the response if free_buf is set. */
+static void
+handler_add_segment(handler_t *h, char *buf, long bufs, int free_buf)
+{
+    handler_args_send_segments_t *a = &h->args.send_segments;
+
+    int i = a->nsegs - HANDLER_INLINE_SEGMENTS;
+    if (i >= a->more_allocated) {
+        int newsize = (a->more_allocated > 0) ? a->more_allocated * 2 : HANDLER_INLINE_SEGMENTS;
+        send_segment_t *tmp = realloc(a->more_segs, newsize * sizeof(send_segment_t));
+        if (!tmp) {
+            fprintf(stderr, "handler_add_segment: realloc() failed.\n");
+            exit(1);
+        }
+        a->more_segs = tmp;
+        a->more_allocated = newsize;
+    }
+
+    send_segment_t *seg = segment_at(a, a->nsegs++);
+    seg->buf = buf;
+    seg->bufs = bufs;
+    seg->free_buf = free_buf;
+    h->resp_size += bufs;
+}
 
-    if (a->headers_bufpos == a->headers_bufs && a->body_buf) {
-        long nwritten = write(sock, a->body_buf, a->body_bufs - a->body_bufpos);
+static void
+handler_init_send_buffer(handler_t *h, char *headers_buf, long headers_bufs, char *body_buf, long body_bufs, int free_body)
+{
+    handler_init_send_segments(h);
+    handler_add_segment(h, headers_buf, headers_bufs, 0);
+    if (body_buf) {
+        handler_add_segment(h, body_buf, body_bufs, free_body);
+    }
+}
+
+/*
+ * The headers are written with MSG_MORE so they go out in the same packet as
+ * the start of the file, which the kernel then copies to the socket directly
+ * from the page cache.
+ */
+static int
+handler_sendfile(int sock, handler_args_t *args)
+{
+    handler_args_sendfile_t *a = &args->sendfile;
+
+    while (a->headers_bufpos < a->headers_bufs) {
+        long nwritten = send(sock, &a->headers_buf[a->headers_bufpos], a->headers_bufs - a->headers_bufpos, MSG_MORE);
         if (nwritten < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return 1;
             }
 
-            fprintf(stderr, "handler_send_buffer: Failed write.\n");
+            fprintf(stderr, "handler_sendfile: Failed write.\n");
             return -1;
         }
+        a->headers_bufpos += nwritten;
+    }
 
-        a->body_bufpos += nwritten;
-        if (a->body_bufpos == a->body_bufs) {
-            return 0;
+    while (a->offset < a->size) {
+        off_t offset = a->offset;
+        long nwritten = sendfile(sock, a->fd, &offset, a->size - a->offset);
+        if (nwritten < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+
+            fprintf(stderr, "handler_sendfile: Failed sendfile.\n");
+            return -1;
         }
+        if (nwritten == 0) {
+            /* File was truncated, the promised Content-Length can't be delivered. */
+            fprintf(stderr, "handler_sendfile: Unexpected end of file.\n");
+            return -1;
+        }
+        a->offset = offset;
     }
 
-    return 1;
+    return 0;
 }
 
 static void
-handler_after_send_buffer(handler_args_t *args)
+handler_after_sendfile(handler_args_t *args)
 {
-    handler_args_send_buffer_t *a = &args->send_buffer;
-    if (a->body_buf && a->free_body) {
-        free(a->body_buf);
-    }
+    close(args->sendfile.fd);
 }
 
 static void
-handler_init_send_buffer(handler_t *h, char *headers_buf, long headers_bufs, char *body_buf, long body_bufs, int free_body)
+handler_init_sendfile(handler_t *h, char *headers_buf, long headers_bufs, int fd, long size)
 {
-    h->handler = handler_send_buffer;
-    h->handler_after = handler_after_send_buffer;
-    h->args.send_buffer.headers_buf = headers_buf;
-    h->args.send_buffer.headers_bufs = headers_bufs;
-    h->args.send_buffer.body_buf = body_buf;
-    h->args.send_buffer.body_bufs = body_bufs;
-    h->args.send_buffer.free_body = free_body;
+    h->handler = handler_sendfile;
+    h->handler_after = handler_after_sendfile;
+    h->handler_pending = NULL;
+    h->handler_advance = NULL;
+    h->args.sendfile.headers_buf = headers_buf;
+    h->args.sendfile.headers_bufpos = 0;
+    h->args.sendfile.headers_bufs = headers_bufs;
+    h->args.sendfile.fd = fd;
+    h->args.sendfile.offset = 0;
+    h->args.sendfile.size = size;
+    h->resp_size = headers_bufs + size;
 }
 
 static void
-write_headers(char **buf, long *bufs, const long body_size, const char *mime_type, const int code)
+write_headers(char **buf, long *bufs, const long body_size, const char *mime_type, const int code, const int keep_alive)
 {
     long bufpos = 0;
     response_add_status_line(*buf, &bufpos, code);
@@ -219,45 +392,99 @@ write_headers(char **buf, long *bufs, const long body_size, const char *mime_typ
     if (mime_type) {
         response_add_content_type(*buf, &bufpos, mime_type);
         response_add_content_length(*buf, &bufpos, body_size);
+    } else {
+        /* Persistent connections need the body length even when there's no body. */
+        response_add_content_length(*buf, &bufpos, 0);
     }
-    response_add_header_field(*buf, &bufpos, "Connection", "close");
+    response_add_header_field(*buf, &bufpos, "Connection", keep_alive ? "keep-alive" : "close");
     *bufs = bufpos;
 }
 
 static void
 serve_file_from_disk_with_code(handler_t *h, const char *filename, const char *mime_type, const int code, const int headers_only)
 {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         fprintf(stderr, "serve_file_from_disk_with_code: Failed to open file %s.\n", filename);
         serve_error_404(h);
         return;
     }
-    fseek(fp, 0, SEEK_END);
-    long fsize = ftell(fp);
-    rewind(fp);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "serve_file_from_disk_with_code: Not a regular file %s.\n", filename);
+        close(fd);
+        serve_error_404(h);
+        return;
+    }
+    long fsize = st.st_size;
 
     char *headers_buf = h->resp_headers_buf;
     long headers_bufs;
-    write_headers(&headers_buf, &headers_bufs, fsize, mime_type, code);
+    write_headers(&headers_buf, &headers_bufs, fsize, mime_type, code, h->keep_alive);
     response_add_header_end(headers_buf, &headers_bufs);
 
     if (headers_only) {
+        close(fd);
         handler_init_send_buffer(h, headers_buf, headers_bufs, NULL, 0, 0);
     } else {
-        char *body_buf = malloc(fsize);
-        if (!body_buf) {
-            fprintf(stderr, "serve_file_from_disk_with_code: malloc() failed.\n");
-            exit(1);
-        }
-        long nwritten = fread(body_buf, 1, fsize, fp);
-        if (nwritten != fsize) {
-            fprintf(stderr, "serve_file_from_disk_with_code: fread() failed.\n");
-            exit(1);
+        /* The file is kept open and streamed by the handler instead of being read into memory. */
+        handler_init_sendfile(h, headers_buf, headers_bufs, fd, fsize);
+    }
+}
+
+static void
+release_upload_cache_entry(void *arg)
+{
+    upload_cache_release(arg);
+}
+
+/* Reads a file into a new cache entry with its headers prebuilt. Returns NULL for files that should be served from disk. */
+static upload_cache_entry_t *
+load_upload_cache_entry(const char *filename, const char *mime_type, unsigned long generation)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UPLOAD_CACHE_MAX_FILE_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    long size = st.st_size;
+    char *body = malloc(size > 0 ? size : 1);
+    if (!body) {
+        fprintf(stderr, "load_upload_cache_entry: malloc() failed.\n");
+        exit(1);
+    }
+    long pos = 0;
+    while (pos < size) {
+        long nread = read(fd, &body[pos], size - pos);
+        if (nread <= 0) {
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "load_upload_cache_entry: Failed to read %s.\n", filename);
+            free(body);
+            close(fd);
+            return NULL;
         }
-        handler_init_send_buffer(h, headers_buf, headers_bufs, body_buf, fsize, 1);
+        pos += nread;
+    }
+    close(fd);
+
+    upload_cache_entry_t *entry = upload_cache_new_entry(filename, body, size);
+    if (!entry) {
+        free(body);
+        return NULL;
     }
-    fclose(fp);
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        char *buf = entry->headers[keep_alive];
+        write_headers(&buf, &entry->headers_len[keep_alive], size, mime_type, 200, keep_alive);
+        response_add_header_end(buf, &entry->headers_len[keep_alive]);
+    }
+    return upload_cache_insert(entry, generation);
 }
 
 static void
@@ -265,7 +492,7 @@ serve_file_from_buffer_with_code(handler_t *h, char *buf, const long bufs, const
 {
     char *headers_buf = h->resp_headers_buf;
     long headers_bufs;
-    write_headers(&headers_buf, &headers_bufs, bufs, mime_type, code);
+    write_headers(&headers_buf, &headers_bufs, bufs, mime_type, code, h->keep_alive);
     response_add_header_end(headers_buf, &headers_bufs);
 
     if (buf) {
@@ -276,21 +503,31 @@ serve_file_from_buffer_with_code(handler_t *h, char *buf, const long bufs, const
 }
 
 static void
-serve_file_from_cache_with_code(handler_t *h, char *filename, const char *mime_type, const int code, const int headers_only)
+release_resource_contents(void *arg)
+{
+    resource_release(arg);
+}
+
+/* The body is sent by reference, holding the version of the file that was current when the response started. */
+static void
+serve_file_from_cache_with_code(handler_t *h, resource_t *resource, const char *mime_type, const int code, const int headers_only)
 {
-    char *body_buf;
-    long body_bufs;
-    resource_cache_get_file_buffer(filename, &body_buf, &body_bufs);
+    resource_contents_t *contents = resource_acquire(resource);
+    char *body_buf = contents->buf;
+    long body_bufs = contents->bufs;
 
     char *headers_buf = h->resp_headers_buf;
     long headers_bufs;
-    write_headers(&headers_buf, &headers_bufs, body_bufs, mime_type, code);
+    write_headers(&headers_buf, &headers_bufs, body_bufs, mime_type, code, h->keep_alive);
     response_add_header_end(headers_buf, &headers_bufs);
 
     if (headers_only) {
         handler_init_send_buffer(h, headers_buf, headers_bufs, NULL, 0, 0);
+        resource_release(contents);
     } else {
         handler_init_send_buffer(h, headers_buf, headers_bufs, body_buf, body_bufs, 0);
+        h->args.send_segments.release = release_resource_contents;
+        h->args.send_segments.release_arg = contents;
     }
 }
 
@@ -300,6 +537,51 @@ serve_file_from_disk(handler_t *h, const char *filename, const char *mime_type,
     serve_file_from_disk_with_code(h, filename, mime_type, 200, headers_only);
 }
 
+/*
+ * Like serve_file_from_disk(), for a file whose size is already known. Small
+ * files are served from the upload cache, by reference and with prebuilt
+ * headers, and HEAD requests don't touch the file at all.
+ */
+void
+serve_file_cached(handler_t *h, const char *filename, const char *mime_type, const long size, const int headers_only)
+{
+    if (headers_only) {
+        char *headers_buf = h->resp_headers_buf;
+        long headers_bufs;
+        write_headers(&headers_buf, &headers_bufs, size, mime_type, 200, h->keep_alive);
+        response_add_header_end(headers_buf, &headers_bufs);
+        handler_init_send_buffer(h, headers_buf, headers_bufs, NULL, 0, 0);
+        return;
+    }
+    if (size > UPLOAD_CACHE_MAX_FILE_SIZE) {
+        serve_file_from_disk(h, filename, mime_type, 0);
+        return;
+    }
+
+    unsigned long generation;
+    upload_cache_entry_t *entry = upload_cache_get(filename, &generation);
+    if (!entry) {
+        entry = load_upload_cache_entry(filename, mime_type, generation);
+        if (!entry) {
+            serve_file_from_disk(h, filename, mime_type, 0);
+            return;
+        }
+    }
+    serve_upload_cache_entry(h, entry);
+}
+
+/* Sends a cached upload by reference with its prebuilt headers. Takes over the caller's reference to entry. */
+void
+serve_upload_cache_entry(handler_t *h, upload_cache_entry_t *entry)
+{
+    int keep_alive = h->keep_alive ? 1 : 0;
+    handler_init_send_segments(h);
+    handler_add_segment(h, entry->headers[keep_alive], entry->headers_len[keep_alive], 0);
+    handler_add_segment(h, entry->body, entry->body_size, 0);
+    h->args.send_segments.release = release_upload_cache_entry;
+    h->args.send_segments.release_arg = entry;
+}
+
 void
 serve_html_file_from_disk(handler_t *h, const char *filename, const int headers_only)
 {
@@ -318,12 +600,41 @@ serve_html_file_from_buffer(handler_t *h, char *buf, const long bufs)
     serve_file_from_buffer_with_code(h, buf, bufs, "text/html", 200);
 }
 
+/*
+ * Sends a page made of the buffers in iov, by reference. release is called
+ * with release_arg once they're no longer needed. iov itself can be freed
+ * right away.
+ */
+void
+serve_html_iovec(handler_t *h, const struct iovec *iov, int iovcnt, const int headers_only, void (*release)(void *), void *release_arg)
+{
+    long body_size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        body_size += iov[i].iov_len;
+    }
+
+    char *headers_buf = h->resp_headers_buf;
+    long headers_bufs;
+    write_headers(&headers_buf, &headers_bufs, body_size, "text/html", 200, h->keep_alive);
+    response_add_header_end(headers_buf, &headers_bufs);
+
+    handler_init_send_segments(h);
+    handler_add_segment(h, headers_buf, headers_bufs, 0);
+    if (!headers_only) {
+        for (int i = 0; i < iovcnt; i++) {
+            handler_add_segment(h, iov[i].iov_base, iov[i].iov_len, 0);
+        }
+    }
+    h->args.send_segments.release = release;
+    h->args.send_segments.release_arg = release_arg;
+}
+
 void
 serve_redirect_303(handler_t *h, char *location)
 {
     char *headers_buf = h->resp_headers_buf;
     long headers_bufs;
-    write_headers(&headers_buf, &headers_bufs, 0, NULL, 303);
+    write_headers(&headers_buf, &headers_bufs, 0, NULL, 303, h->keep_alive);
     response_add_header_field(headers_buf, &headers_bufs, "Location", location);
     response_add_header_end(headers_buf, &headers_bufs);
 
@@ -333,17 +644,31 @@ serve_redirect_303(handler_t *h, char *location)
 void
 serve_error_400(handler_t *h)
 {
-    serve_file_from_cache_with_code(h, "html/400.html", "text/html", 400, 0);
+    serve_file_from_cache_with_code(h, error_400_page, "text/html", 400, 0);
 }
 
 void
 serve_error_404(handler_t *h)
 {
-    serve_file_from_cache_with_code(h, "html/404.html", "text/html", 404, 0);
+    serve_file_from_cache_with_code(h, error_404_page, "text/html", 404, 0);
 }
 
 void
 serve_error_500(handler_t *h)
 {
-    serve_file_from_cache_with_code(h, "html/500.html", "text/html", 500, 0);
+    serve_file_from_cache_with_code(h, error_500_page, "text/html", 500, 0);
+}
+
+/* Writes a complete 503 response without a body into buf and returns its length. buf must hold RESPONSE_OVERLOAD_MAX_SIZE bytes. */
+long
+write_overload_response(char *buf, const int retry_after)
+{
+    char retry_after_str[16];
+    snprintf(retry_after_str, sizeof(retry_after_str), "%d", retry_after);
+
+    long bufs;
+    write_headers(&buf, &bufs, 0, NULL, 503, 0);
+    response_add_header_field(buf, &bufs, "Retry-After", retry_after_str);
+    response_add_header_end(buf, &bufs);
+    return bufs;
 }
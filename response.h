@@ -1,30 +1,73 @@
+struct iovec;
+struct upload_cache_entry;
+
+#define HANDLER_INLINE_SEGMENTS 4
+
+typedef struct {
+    char *buf;
+    long bufs;
+    int free_buf;
+} send_segment_t;
+
+/* Response sent as a list of buffers, headers first. */
+typedef struct {
+    send_segment_t segs[HANDLER_INLINE_SEGMENTS];
+    send_segment_t *more_segs; /* Segments past the inline ones. Not a pointer into this struct, since handlers are moved with their connection. */
+    int more_allocated;
+    int nsegs;
+    int seg; /* First segment that isn't fully sent. */
+    long segpos; /* Bytes of segs[seg] already sent. */
+    void (*release)(void *); /* Called with release_arg after the response, to drop a reference to shared segment data. */
+    void *release_arg;
+} handler_args_send_segments_t;
+
+/* File streamed with sendfile(), the handler owns fd and closes it after the response. */
 typedef struct {
     char *headers_buf;
     long headers_bufpos;
     long headers_bufs;
-    char *body_buf;
-    long body_bufpos;
-    long body_bufs;
-    int free_body;
-} handler_args_send_buffer_t;
+    int fd;
+    long offset;
+    long size;
+} handler_args_sendfile_t;
 
 typedef union {
-    handler_args_send_buffer_t send_buffer;
+    handler_args_send_segments_t send_segments;
+    handler_args_sendfile_t sendfile;
 } handler_args_t;
 
 typedef struct {
     int (*handler)(int, handler_args_t *); /* Returns: 1 == continue, 0 == done, -1 == error */
     void (*handler_after)(handler_args_t *);
+    /*
+     * Optional, for completion based I/O where the caller does the writes:
+     * handler_pending fills iov with the data still to be sent and returns the
+     * number of entries (0 when done), handler_advance consumes n sent bytes.
+     */
+    int (*handler_pending)(handler_args_t *, struct iovec *, int);
+    void (*handler_advance)(handler_args_t *, long);
     handler_args_t args;
     char *resp_headers_buf;
+    int keep_alive; /* Set before routing, decides the Connection field of the response. */
+    long resp_size; /* Total bytes of the response, headers included. */
 } handler_t;
 
+#define HANDLER_MAX_IOV 64 /* Segments handed to a single writev(). */
+#define RESPONSE_OVERLOAD_MAX_SIZE 256
+
+void response_init(void);
+
 void serve_file_from_disk(handler_t *h, const char *filename, const char *mime_type, const int headers_only);
 void serve_html_file_from_disk(handler_t *h, const char *filename, const int headers_only);
+void serve_file_cached(handler_t *h, const char *filename, const char *mime_type, const long size, const int headers_only);
+void serve_upload_cache_entry(handler_t *h, struct upload_cache_entry *entry);
 void serve_file_from_buffer(handler_t *h, char *buf, const long bufs, const char *mime_type);
 void serve_html_file_from_buffer(handler_t *h, char *buf, const long bufs);
+void serve_html_iovec(handler_t *h, const struct iovec *iov, int iovcnt, const int headers_only, void (*release)(void *), void *release_arg);
 
 void serve_redirect_303(handler_t *h, char *location);
 void serve_error_400(handler_t *h);
 void serve_error_404(handler_t *h);
 void serve_error_500(handler_t *h);
+
+long write_overload_response(char *buf, const int retry_after);
@@ -11,6 +11,9 @@
 #include "forum.h"
 #include "config.h"
 #include "routing.h"
+#include "multipart.h"
+#include "upload_index.h"
+#include "upload_cache.h"
 
 typedef struct {
     const char *key;
@@ -34,6 +37,7 @@ typedef struct {
     const int optional;
     char *value;
     long value_len;
+    multipart_part_t *file; /* Set instead of value for fields accepting files, the data is in a temporary file. */
     int ok;
 } form_field_t;
 
@@ -56,6 +60,7 @@ typedef struct {
     const int nff;
     const long max_body_size;
     void (*const fun)(handler_t *h, routeargs_t *args);
+    int (*const fun_nonblocking)(handler_t *h, routeargs_t *args); /* Like fun, but returns 1 without serving the request if it would wait for the disk. NULL if fun never does. */
 } route_t;
 
 typedef struct {
@@ -64,13 +69,14 @@ typedef struct {
     const int len;
 } filesig_t;
 
+/* head holds the first MULTIPART_FILE_HEAD_SIZE bytes of a file of size bytes. */
 static enum upload_content_type
-validate_uploaded_file(const char *buf, const long bufs, const unsigned int content_type, const int maxsize)
+validate_uploaded_file(const unsigned char *head, const long size, const unsigned int content_type, const int maxsize)
 {
-    if (!buf)
+    if (!head)
         return UCT_NONE;
     
-    if (bufs < 100 || bufs > maxsize)
+    if (size < 100 || size > maxsize)
         return UCT_NONE;
     
     switch (content_type) {
@@ -81,7 +87,7 @@ validate_uploaded_file(const char *buf, const long bufs, const unsigned int cont
             };
 
             for (int i = 0; i < png_signature.len; i++) {
-                if (png_signature.sig[i] != (unsigned char) buf[i]) {
+                if (png_signature.sig[i] != head[i]) {
                     fprintf(stderr, "validate_uploaded_file: Invalid png signature.\n");
                     return UCT_NONE;
                 }
@@ -116,7 +122,7 @@ validate_uploaded_file(const char *buf, const long bufs, const unsigned int cont
                 const filesig_t *fs = &jpg_signatures[i];
                 int ok = 1;
                 for (int j = 0; j < fs->len; j++) {
-                    if (fs->sig[j] != (unsigned char) buf[j] && !fs->mask[j]) {
+                    if (fs->sig[j] != head[j] && !fs->mask[j]) {
                         ok = 0;
                         break;
                     }
@@ -195,175 +201,45 @@ parse_params(char *params, parameter_t *p, int np)
     return 0;
 }
 
-static char *
-find_in_string(char *haystack, const int hn, const char *needle, const int nn)
-{
-    for (int i = 0; i <= hn - nn; i++) {
-        int j;
-        for (j = 0; j < nn; j++) {
-            if (haystack[i + j] != needle[j])
-                break;
-        }
-        if (j == nn) {
-            return (haystack + i);
-        }
-    }
-    return NULL;
-}
-
+/* Matches the parts of a parsed multipart/form-data body to the route's form fields. */
 static int
-parse_mutlipart_form_data(char *buf, long bufs, char *boundary, form_field_t *ff, int nff)
+get_form_fields(multipart_t *mp, form_field_t *ff, int nff)
 {
-    if (bufs < 50) {
-        return 1;
-    }
-    if (buf[bufs - 4] != '-' || buf[bufs - 3] != '-' || buf[bufs - 2] != '\r' || buf[bufs - 1] != '\n') {
-        return 1;
-    }
-    char *lastbyte = &buf[bufs - 4];
-
-    int blen = strlen(boundary);
-
-    const char content_disposition[] = "Content-Disposition: form-data;";
-    const int cdlen = sizeof(content_disposition) - 1;
-    const char name_key[] = "name=\"";
-    const int nklen = sizeof(name_key) - 1;
-    const char content_type[] = "Content-Type: ";
-    const int ctlen = sizeof(content_type) - 1;
+    int nparts = multipart_nparts(mp);
+    for (int i = 0; i < nparts; i++) {
+        multipart_part_t *part = multipart_part(mp, i);
 
-    char *t = buf;
-    char *t2;
-    char *t3;
-
-    t = find_in_string(t, lastbyte - t, boundary, blen);
-    if (!t) {
-        return 1;
-    }
-    t += blen;
-    /* t after end of first boundary */
-
-    t = find_in_string(t, lastbyte - t, "\r\n", 2);
-    if (!t) {
-        return 1;
-    }
-    t += 2;
-    /* t on beginning of chunk's first line */
-
-    while (1) {
         form_field_t *f = NULL;
-
-        t = find_in_string(t, lastbyte - t, content_disposition, cdlen);
-        if (!t) {
-            return 1;
-        }
-        t += cdlen;
-
-        while (*t == ' ')
-            t++;
-
-        t = find_in_string(t, lastbyte - t, name_key, nklen);
-        if (!t) {
-            return 1;
-        }
-        t += nklen;
-        /* t on start of field name */
-
-        t2 = find_in_string(t, lastbyte - t, "\r\n", 2);
-        if (!t2) {
-            return 1;
-        }
-
-        char *name = t;
-        int namelen = 0;
-        while (t < t2) {
-            t++;
-            namelen++;
-            if (!isalnum(*t))
-                break;
-        }
-        for (int i = 0; i < nff; i++) {
-            if (strncmp(name, ff[i].key, namelen) == 0) {
-                f = &ff[i];
+        for (int j = 0; j < nff; j++) {
+            if (strcmp(part->name, ff[j].key) == 0) {
+                f = &ff[j];
             }
         }
         if (!f) {
-#if 0
-            fprintf(stderr, "parse_multipart_form_data: Invalid name: ");
-            for (int i = 0; i < namelen; i++)
-                fprintf(stderr, "%c", name[i]);
-            fprintf(stderr, ".\n");
-#endif
             return 1;
         }
 
-        t = t2 + 2;
-        /* t on beginning of chunk's second line */
-
-        t2 = find_in_string(t, lastbyte - t, boundary, blen);
-        if (!t2) {
-            return 1;
-        }
-        char *value_end = t2 - 2;
-        t3 = find_in_string(t, t2 - t, content_type, ctlen);
-        if (t3) {
-            if (t3 != t) {
+        if (part->is_file) {
+            if (f->accepted_content_types == UCT_NONE) {
                 return 1;
             }
-            t3 += ctlen;
-
-            char *mime_type = t3;
-            int mime_type_len = 0;
-            while (t3 < t2) {
-                t3++;
-                mime_type_len++;
-                if (!isalnum(*t3) && *t3 != '/' && *t3 != '-')
-                    break;
-            }
-            int ok = 0;
-            if (strncmp(mime_type, "image/png", mime_type_len) == 0) {
-                if (f->accepted_content_types & UCT_IMAGE_PNG) {
-                    f->content_type = UCT_IMAGE_PNG;
-                    ok = 1;
-                }
-            } else if (strncmp(mime_type, "image/jpeg", mime_type_len) == 0) {
-                if (f->accepted_content_types & UCT_IMAGE_JPEG) {
-                    f->content_type = UCT_IMAGE_JPEG;
-                    ok = 1;
-                }
+            unsigned int content_type = UCT_NONE;
+            if (strcmp(part->content_type, "image/png") == 0) {
+                content_type = UCT_IMAGE_PNG;
+            } else if (strcmp(part->content_type, "image/jpeg") == 0) {
+                content_type = UCT_IMAGE_JPEG;
             }
-            if (!ok) {
-#if 0
-                fprintf(stderr, "parse_multipart_form_data: Unhandled mime_type: ");
-                for (int i = 0; i < mime_type_len; i++)
-                    fprintf(stderr, "%c", mime_type[i]);
-                fprintf(stderr, ".\n");
-#endif
+            /* Unhandled types and empty file inputs leave the field unset. */
+            if (part->size > 0 && (f->accepted_content_types & content_type)) {
+                f->content_type = content_type;
+                f->file = part;
+                f->ok = 1;
             }
-
-            t = find_in_string(t3, lastbyte - t3, "\r\n", 2);
-            if (!t) {
-                return 1;
-            }
-            t += 2;
-            /* t on beginning of chunk's third line */
-        }
-
-        t = find_in_string(t, lastbyte - t, "\r\n", 2);
-        if (!t) {
-            return 1;
-        }
-        t += 2;
-        char *value_start = t;
-
-        if (value_start < value_end && (f->accepted_content_types == UCT_NONE || f->content_type != UCT_NONE)) {
-            f->value = value_start;
-            f->value_len = value_end - value_start;
+        } else if (part->value_len > 0) {
+            f->value = part->value;
+            f->value_len = part->value_len;
             f->ok = 1;
         }
-
-        if (value_end + 2 + blen >= lastbyte) {
-            break;
-        }
     }
 
     for (int i = 0; i < nff; i++) {
@@ -516,8 +392,7 @@ route_post(handler_t *h, routeargs_t *args)
     long thread_id = -1;
     char subject[THREAD_SUBJECT_MAXLEN] = {0};
 
-    char *file = NULL;
-    long filesize;
+    multipart_part_t *file = NULL;
 
     for (int i = 0; i < args->nff; i++) {
         form_field_t *f = &args->ff[i];
@@ -584,7 +459,7 @@ route_post(handler_t *h, routeargs_t *args)
 
         } else if (strcmp(f->key, "file") == 0) {
 
-            enum upload_content_type uct = validate_uploaded_file(f->value, f->value_len, f->content_type, POST_FILE_MAXSIZE);
+            enum upload_content_type uct = validate_uploaded_file(f->file->head, f->file->size, f->content_type, POST_FILE_MAXSIZE);
             if (uct == UCT_NONE) {
                 fprintf(stderr, "route_post: Failed to validate uploaded file.\n");
                 goto invalid;
@@ -607,30 +482,35 @@ route_post(handler_t *h, routeargs_t *args)
                 } break;
             }
 
-            gen_filename(post.filename, POST_FILENAME_MAXLEN, ext, extlen);
-            file = f->value;
-            filesize = f->value_len;
+            gen_filename(post.filename, POST_FILENAME_MAXLEN, f->file->digest, ext, extlen);
+            file = f->file;
         }
     }
 
+    /*
+     * The file is stored before the post exists, so the post's reference is
+     * counted by the time it can be deleted. The upload was streamed to a
+     * temporary file next to the final one, so this is at most a rename.
+     */
+    if (file && upload_index_store(file, post.filename) != 0) {
+        fprintf(stderr, "route_post: Failed to save uploaded file.\n");
+        goto failed;
+    }
+
     if (thread_id == -1) {
         int ret = thread_create(&post, subject);
         if (ret != 0) {
             fprintf(stderr, "route_post: Failed to create thread.\n");
-            goto invalid;
+            goto invalid_stored;
         }
     } else {
         int ret = post_create(thread_id, &post);
         if (ret != 0) {
             fprintf(stderr, "route_post: Failed to create post.\n");
-            goto invalid;
+            goto invalid_stored;
         }
     }
 
-    if (file) {
-        save_file(file, filesize, post.filename, "uploads");
-    }
-
     char redir[128];
     int nwritten;
     if (thread_id == -1) {
@@ -647,52 +527,102 @@ route_post(handler_t *h, routeargs_t *args)
     
     return;
 
+invalid_stored:
+    if (file) {
+        upload_index_unref(post.filename);
+    }
 invalid:
     if (post.comment) {
         free(post.comment);
     }
     serve_error_400(h);
+    return;
+
+/* The temporary file that wasn't saved is removed with the rest of the request's form. */
+failed:
+    if (post.comment) {
+        free(post.comment);
+    }
+    serve_error_500(h);
 }
 
-static void
-route_uploads(handler_t *h, routeargs_t *args)
+/*
+ * Looks up the upload the request is for. Returns 0 and the file's path, size
+ * and mime type if it exists. Files that aren't in the index don't exist, so
+ * there's no need to look for them on disk.
+ */
+static int
+find_upload(const char *filename, char *path, long *size, const char **mime_type)
 {
-    char *filename = args->path_rem;
     int len = strlen(filename);
     
     if (len < 5)
-        goto err404;
+        return -1;
 
-    if (len > 30)
-        goto err404;
+    if (len + 1 > UPLOAD_INDEX_NAME_MAXLEN)
+        return -1;
     
+    /* Uploads are stored in subdirectories named after the first two characters. */
     for (int i = 0; i < len; i++) {
         char c = filename[i];
-        if (!isalnum(c) && c != '.') {
-            goto err404;
+        if (!isalnum(c) && c != '.' && !(c == '/' && i == 2)) {
+            return -1;
         }
     }
     
-    char *mime_type;
-    if (strcmp(&filename[len - 4], ".png") == 0) {
-        mime_type = "image/png";
-    } else if (strcmp(&filename[len - 4], ".jpg") == 0) {
-        mime_type = "image/jpeg";
-    } else {
-        goto err404;
+    if (upload_index_lookup(filename, size, mime_type) != 0) {
+        return -1;
     }
 
     static const char dir[] = "uploads/";
-    char path[128];
     memcpy(path, dir, sizeof(dir) - 1);
     memcpy(&path[sizeof(dir) - 1], filename, len + 1);
+    return 0;
+}
 
-    serve_file_from_disk(h, path, mime_type, args->headers_only);
+static void
+route_uploads(handler_t *h, routeargs_t *args)
+{
+    char path[128];
+    long size;
+    const char *mime_type;
+    if (find_upload(args->path_rem, path, &size, &mime_type) != 0) {
+        serve_error_404(h);
+        return;
+    }
 
-    return;
+    serve_file_cached(h, path, mime_type, size, args->headers_only);
+}
 
-err404:
-    serve_error_404(h);
+/*
+ * Only files that have to be read from disk block, misses and cached files
+ * are answered from memory. The cache entry is served with the reference
+ * taken to check for it, so it can't be evicted in between.
+ */
+static int
+route_uploads_nonblocking(handler_t *h, routeargs_t *args)
+{
+    char path[128];
+    long size;
+    const char *mime_type;
+    if (find_upload(args->path_rem, path, &size, &mime_type) != 0) {
+        serve_error_404(h);
+        return 0;
+    }
+    if (args->headers_only) {
+        serve_file_cached(h, path, mime_type, size, 1);
+        return 0;
+    }
+    if (size > UPLOAD_CACHE_MAX_FILE_SIZE) {
+        return 1;
+    }
+    unsigned long generation;
+    upload_cache_entry_t *entry = upload_cache_get(path, &generation);
+    if (!entry) {
+        return 1;
+    }
+    serve_upload_cache_entry(h, entry);
+    return 0;
 }
 
 static const parameter_t params_report[] = {
@@ -755,6 +685,7 @@ static const route_t routes[] = {
         .path = "/uploads/",
         .path_wildcard = 1,
         .fun = route_uploads,
+        .fun_nonblocking = route_uploads_nonblocking,
     }, {
         .meth = RM_GET,
         .path = "/",
@@ -799,6 +730,42 @@ validate_post_request(request_t *req)
     return VALIDATE_POST_REQUEST_400;
 }
 
+/*
+ * Routes the GET or HEAD request req unless that would wait for the disk.
+ * Returns 1 without setting up h if it would, the request is then routed with
+ * do_routing() on the disk pool. POST requests always would.
+ */
+int
+try_routing(handler_t *h, request_t *req)
+{
+    routeargs_t args = {0};
+    int nroutes = sizeof(routes) / sizeof(route_t);
+
+    for (int i = 0; i < nroutes; i++) {
+        const route_t *route = &routes[i];
+
+        if (route->meth != RM_GET)
+            continue;
+        args.headers_only = (req->meth == RM_HEAD);
+
+        if (route->path_wildcard) {
+            int len = strlen(route->path);
+            if (strncmp(req->path, route->path, len) != 0)
+                continue;
+            args.path_rem = req->path + len;
+        } else if (strcmp(req->path, route->path) != 0) {
+            continue;
+        }
+
+        if (route->fun_nonblocking) {
+            return route->fun_nonblocking(h, &args);
+        }
+        break;
+    }
+    do_routing(h, req);
+    return 0;
+}
+
 void
 do_routing(handler_t *h, request_t *req)
 {
@@ -853,14 +820,14 @@ do_routing(handler_t *h, request_t *req)
                 if (req->body_bufpos != req->content_length) {
                     goto err500;
                 }
-                if (!*req->boundary) {
+                if (!req->form) {
                     goto err500;
                 }
 
                 form_field_t ff[route->nff];
                 memcpy(ff, route->ff, sizeof(ff));
 
-                int ret = parse_mutlipart_form_data(req->body_buf, req->content_length, req->boundary, ff, route->nff);
+                int ret = get_form_fields(req->form, ff, route->nff);
                 if (ret != 0) {
                     fprintf(stderr, "do_routing: Invalid form fields.\n");
                     goto err400;
@@ -9,4 +9,5 @@ enum validate_post_request_result {
 };
 
 enum validate_post_request_result validate_post_request(request_t *req);
+int try_routing(handler_t *h, request_t *req);
 void do_routing(handler_t *h, request_t *req);
@@ -0,0 +1,15 @@
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; /* Bytes hashed so far. */
+    unsigned char block[SHA256_BLOCK_SIZE];
+    int block_len;
+} sha256_t;
+
+void sha256_init(sha256_t *s);
+void sha256_update(sha256_t *s, const void *data, long len);
+void sha256_final(sha256_t *s, unsigned char *digest);
@@ -1,181 +1,133 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "config.h"
 #include "utils.h"
 #include "response.h"
 #include "forum.h"
 #include "resource_cache.h"
+#include "page_cache.h"
 #include "templating.h"
 
-#define MAX_FUN_ARG_LEN 50
+#define TEMPLATE_LINE_MAXLEN 1024
+#define TEMPLATE_LITERAL -1
 
-static long
-snp_post_in_thread_img(char *s, long n, char *format,
-        char *name, char *timestamp, long post_id, char *filename, char *comment)
-{
-    return snprintf(s, n, format,
-            post_id, name, timestamp, post_id, post_id, post_id, filename, filename, comment);
-}
+/* A slice of the compiled text, or slot fun: a function of a page or a field of a post part. */
+typedef struct {
+    int fun;
+    long pos;
+    long len;
+} template_instr_t;
 
-static long
-snp_post_in_thread_noimg(char *s, long n, char *format,
-        char *name, char *timestamp, long post_id, char *comment)
-{
-    return snprintf(s, n, format,
-            post_id, name, timestamp, post_id, post_id, post_id, comment);
-}
+/*
+ * A template turned into its text, with the included parts already copied
+ * in, and the instructions that render it. Templates are compiled again when
+ * any of their files is reloaded, and a render holds a reference to the
+ * version it started with.
+ */
+typedef struct {
+    char *text;
+    long textpos;
+    long texts;
+    template_instr_t *instrs;
+    int ninstrs;
+    int instrs_allocated;
+    int refs;
+} compiled_template_t;
 
-static long
-snp_post_in_catalog(char *s, long n, char *format,
-        char *subject, char *name, char *timestamp, long post_id, char *filename, char *comment)
-{
-    return snprintf(s, n, format,
-            subject, name, timestamp, post_id, post_id, filename, filename, comment, post_id);
-}
+/* Slot functions of each page, indexed by their number in the instructions. */
+enum thread_fun {
+    THREAD_FUN_TITLE,
+    THREAD_FUN_NEW_POST_FORM,
+    THREAD_FUN_POSTS_IN_THREAD,
+};
+static const char *const thread_funs[] = { "title", "new_post_form", "posts_in_thread", NULL };
 
-static void
-tfun_include(char **buf, long *bufpos, long *bufs, const char *filename)
-{
-    int len = strlen(filename);
-    const char template_parts_dir[] = "templates/parts/";
-    char part_path[100];
-    memcpy(part_path, template_parts_dir, sizeof(template_parts_dir) - 1);
-    if (sizeof(template_parts_dir) + len > 100) {
-        fprintf(stderr, "tfun_include: Template part path+filename too large.\n");
-        exit(1);
-    }
-    memcpy(&part_path[sizeof(template_parts_dir) - 1], filename, len + 1);
+enum catalog_fun {
+    CATALOG_FUN_POSTS_IN_CATALOG,
+};
+static const char *const catalog_funs[] = { "posts_in_catalog", NULL };
 
-    char *fbuf;
-    long fbufs;
-    resource_cache_get_file_buffer(part_path, &fbuf, &fbufs);
+/* Post fields that fill the printf-style slots of the post parts, listed in the order of the slots. */
+enum post_field {
+    POST_FIELD_POST_ID, /* %ld, all others are %s. */
+    POST_FIELD_NAME,
+    POST_FIELD_TIMESTAMP,
+    POST_FIELD_FILENAME,
+    POST_FIELD_COMMENT,
+    POST_FIELD_SUBJECT,
+    POST_FIELD_END,
+};
+static const enum post_field post_in_thread_img_fields[] = {
+    POST_FIELD_POST_ID, POST_FIELD_NAME, POST_FIELD_TIMESTAMP, POST_FIELD_POST_ID, POST_FIELD_POST_ID, POST_FIELD_POST_ID,
+    POST_FIELD_FILENAME, POST_FIELD_FILENAME, POST_FIELD_COMMENT, POST_FIELD_END,
+};
+static const enum post_field post_in_thread_noimg_fields[] = {
+    POST_FIELD_POST_ID, POST_FIELD_NAME, POST_FIELD_TIMESTAMP, POST_FIELD_POST_ID, POST_FIELD_POST_ID, POST_FIELD_POST_ID,
+    POST_FIELD_COMMENT, POST_FIELD_END,
+};
+static const enum post_field post_in_catalog_fields[] = {
+    POST_FIELD_SUBJECT, POST_FIELD_NAME, POST_FIELD_TIMESTAMP, POST_FIELD_POST_ID, POST_FIELD_POST_ID,
+    POST_FIELD_FILENAME, POST_FIELD_FILENAME, POST_FIELD_COMMENT, POST_FIELD_POST_ID, POST_FIELD_END,
+};
 
-    if (*bufpos + fbufs + 1 > *bufs) {
-        long newsize = *bufpos + fbufs + 1;
-        char *newbuf = realloc(*buf, newsize);
-        if (!newbuf) {
-            fprintf(stderr, "tfun_include: realloc() failed.\n");
-            exit(1);
-        }
-        *buf = newbuf;
-        *bufs = newsize;
-    }
+static compiled_template_t *thread_page;
+static compiled_template_t *catalog_page;
+static compiled_template_t *post_in_thread_img_format;
+static compiled_template_t *post_in_thread_noimg_format;
+static compiled_template_t *post_in_catalog_format;
+static pthread_mutex_t templates_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    memcpy(&(*buf)[*bufpos], fbuf, fbufs);
-    *bufpos += fbufs;
-    (*buf)[(*bufpos)++] = '\n';
-}
+/* Resolved by templating_init(), rendering never looks files up by name. */
+static resource_t *thread_template;
+static resource_t *catalog_template;
+static resource_t *new_post_form_part;
+static resource_t *post_in_thread_img_part;
+static resource_t *post_in_thread_noimg_part;
+static resource_t *post_in_catalog_part;
+static resource_t *no_threads_active_part;
 
+/* Makes room for len more bytes at bufpos. */
 static void
-tfun_title(char **buf, long *bufpos, long *bufs, const char *title)
+reserve(char **buf, long bufpos, long *bufs, long len)
 {
-    const char t[] = "<title>%s</title>\n";
-    int nwritten = snprintf(&(*buf)[*bufpos], *bufs - *bufpos, t, title);
-    if (*bufpos + nwritten > *bufs) {
-        fprintf(stderr, "tfun_title: Buffer too small.\n");
-        exit(1);
+    if (bufpos + len <= *bufs) {
+        return;
     }
-    *bufpos += nwritten;
-}
-
-static void
-tfun_new_post_form(char **buf, long *bufpos, long *bufs, const long thread_id)
-{
-    char *format;
-    resource_cache_get_file_buffer("templates/parts/new_post_form.html", &format, NULL);
-
-    int nwritten = snprintf(&(*buf)[*bufpos], *bufs - *bufpos, format, thread_id);
-    if (*bufpos + nwritten > *bufs) {
-        fprintf(stderr, "tfun_new_post_form: Buffer too small.\n");
+    long newsize = *bufs > 0 ? *bufs * 2 : 1024;
+    while (bufpos + len > newsize) {
+        newsize *= 2;
+    }
+    char *newbuf = realloc(*buf, newsize);
+    if (!newbuf) {
+        fprintf(stderr, "reserve: realloc() failed.\n");
         exit(1);
     }
-    *bufpos += nwritten;
+    *buf = newbuf;
+    *bufs = newsize;
 }
 
 static void
-tfun_posts_in_thread(char **buf, long *bufpos, long *bufs, post_t *posts, long nposts)
+tfun_title(char **buf, long *bufpos, long *bufs, const char *title)
 {
-    char *format_img;
-    resource_cache_get_file_buffer("templates/parts/post_in_thread_img.html", &format_img, NULL);
-    char *format_noimg;
-    resource_cache_get_file_buffer("templates/parts/post_in_thread_noimg.html", &format_noimg, NULL);
-
-    for (long i = 0; i < nposts; i++) {
-        post_t *p = &posts[i];
-        if (p->hidden) {
-            continue;
-        }
-        while (1) {
-            int ok = 1;
-            long nwritten;
-            if (*p->filename) {
-                nwritten = snp_post_in_thread_img(&(*buf)[*bufpos], *bufs - *bufpos, format_img,
-                        p->name, p->timestamp, p->post_id, p->filename, p->comment);
-            } else {
-                nwritten = snp_post_in_thread_noimg(&(*buf)[*bufpos], *bufs - *bufpos, format_noimg,
-                        p->name, p->timestamp, p->post_id, p->comment);
-            }
-            if (*bufpos + nwritten + 1 > *bufs) {
-                ok = 0;
-                long newsize = *bufs * 2;
-                if (newsize >= MAX_RESP_SIZE_1) {
-                    fprintf(stderr, "tfun_posts_in_thread: Buffer size would exceed MAX_RESP_SIZE_1.\n");
-                    exit(1);
-                }
-                char *newbuf = realloc(*buf, newsize);
-                if (!newbuf) {
-                    fprintf(stderr, "tfun_posts_in_thread: realloc() failed.\n");
-                    exit(1);
-                }
-                *buf = newbuf;
-                *bufs = newsize;
-            }
-            if (ok) {
-                *bufpos += nwritten;
-                break;
-            }
-        }
-        (*buf)[(*bufpos)++] = '\n';
-    }
+    const char t[] = "<title>%s</title>\n";
+    int len = snprintf(NULL, 0, t, title);
+    reserve(buf, *bufpos, bufs, len + 1);
+    *bufpos += snprintf(&(*buf)[*bufpos], len + 1, t, title);
 }
 
+/* The form part can be edited and reloaded while the server runs, so its size is only known here. */
 static void
-tfun_posts_in_catalog(char **buf, long *bufpos, long *bufs, thread_t *threads, long nthreads)
+tfun_new_post_form(char **buf, long *bufpos, long *bufs, const long thread_id)
 {
-    char *format;
-    resource_cache_get_file_buffer("templates/parts/post_in_catalog.html", &format, NULL);
-
-    for (long i = 0; i < nthreads; i++) {
-        thread_t *t = &threads[i];
-        post_t *p = &t->posts[0];
-        while (1) {
-            int ok = 1;
-            long nwritten = snp_post_in_catalog(&(*buf)[*bufpos], *bufs - *bufpos, format,
-                    t->subject, p->name, p->timestamp, p->post_id, p->filename, p->comment);
-            if (*bufpos + nwritten + 1 > *bufs) {
-                ok = 0;
-                long newsize = *bufs * 2;
-                if (newsize >= MAX_RESP_SIZE_1) {
-                    fprintf(stderr, "tfun_posts_in_catalog: Buffer size would exceed MAX_RESP_SIZE_1.\n");
-                    exit(1);
-                }
-                char *newbuf = realloc(*buf, newsize);
-                if (!newbuf) {
-                    fprintf(stderr, "tfun_posts_in_catalog: realloc() failed.\n");
-                    exit(1);
-                }
-                *buf = newbuf;
-                *bufs = newsize;
-            }
-            if (ok) {
-                *bufpos += nwritten;
-                break;
-            }
-        }
-        (*buf)[(*bufpos)++] = '\n';
-    }
+    resource_contents_t *contents = resource_acquire(new_post_form_part);
+    int len = snprintf(NULL, 0, contents->buf, thread_id);
+    reserve(buf, *bufpos, bufs, len + 1);
+    *bufpos += snprintf(&(*buf)[*bufpos], len + 1, contents->buf, thread_id);
+    resource_release(contents);
 }
 
 static int
@@ -200,6 +152,7 @@ parse_template_line(char *line, char **cmd, char **arg)
     return 0;
 }
 
+/* Returns the length of the line, 0 at the end of buf and -1 if the line doesn't fit. */
 static long
 get_line(const char *buf, long *bufpos, long bufs, char *linebuf, long linebufs)
 {
@@ -217,148 +170,590 @@ get_line(const char *buf, long *bufpos, long bufs, char *linebuf, long linebufs)
     }
     if (i == linebufs - 1) {
         fprintf(stderr, "get_line: Line buffer too small.\n");
-        exit(1);
+        return -1;
     }
     linebuf[i] = '\0';
     return i;
 }
 
+static void
+free_compiled_template(compiled_template_t *t)
+{
+    free(t->text);
+    free(t->instrs);
+    free(t);
+}
+
+static void
+add_instr(compiled_template_t *t, int fun, long pos, long len)
+{
+    if (t->ninstrs == t->instrs_allocated) {
+        int newsize = (t->instrs_allocated > 0) ? t->instrs_allocated * 2 : 16;
+        template_instr_t *tmp = realloc(t->instrs, newsize * sizeof(template_instr_t));
+        if (!tmp) {
+            fprintf(stderr, "add_instr: realloc() failed.\n");
+            exit(1);
+        }
+        t->instrs = tmp;
+        t->instrs_allocated = newsize;
+    }
+    template_instr_t *in = &t->instrs[t->ninstrs++];
+    in->fun = fun;
+    in->pos = pos;
+    in->len = len;
+}
+
+/* Consecutive literals are merged into a single slice. */
+static void
+add_literal(compiled_template_t *t, char *str, long len)
+{
+    long pos = t->textpos;
+    append_to_buffer_realloc_if_necessary(&t->text, &t->textpos, &t->texts, str, len);
+    template_instr_t *last = (t->ninstrs > 0) ? &t->instrs[t->ninstrs - 1] : NULL;
+    if (last && last->fun == TEMPLATE_LITERAL) {
+        last->len += len;
+    } else {
+        add_instr(t, TEMPLATE_LITERAL, pos, len);
+    }
+}
+
 static int
-parse_template(char *fbuf, long *fbufpos, long fbufs, char **buf, long *bufpos, long *bufs, char *arg)
+compile_include(compiled_template_t *t, const char *filename)
+{
+    char part_path[100];
+    int n = snprintf(part_path, sizeof(part_path), "templates/parts/%s", filename);
+    if (n + 1 > (int)sizeof(part_path)) {
+        fprintf(stderr, "compile_include: Template part path+filename too large.\n");
+        return -1;
+    }
+    resource_t *part = resource_cache_try_resolve(part_path);
+    if (!part) {
+        return -1;
+    }
+    resource_contents_t *contents = resource_acquire(part);
+    add_literal(t, contents->buf, contents->bufs);
+    add_literal(t, "\n", 1);
+    resource_release(contents);
+    return 0;
+}
+
+static compiled_template_t *
+new_compiled_template(void)
 {
-    long linebufs = 1024;
-    char linebuf[linebufs];
+    compiled_template_t *t = calloc(1, sizeof(compiled_template_t));
+    if (!t) {
+        fprintf(stderr, "new_compiled_template: calloc() failed.\n");
+        exit(1);
+    }
+    t->refs = 1;
+    return t;
+}
+
+/*
+ * Turns the template into literal slices and calls to the functions named in
+ * funs, which get their index in funs as their number. Returns NULL if the
+ * template is invalid.
+ */
+static compiled_template_t *
+compile_template(resource_t *r, const char *const *funs)
+{
+    compiled_template_t *t = new_compiled_template();
+
+    resource_contents_t *contents = resource_acquire(r);
+    long fbufpos = 0;
+    char line[TEMPLATE_LINE_MAXLEN];
     long len;
-    while ((len = get_line(fbuf, fbufpos, fbufs, linebuf, linebufs)) > 0) {
-        if (linebuf[0] != '{' || linebuf[1] != '{') {
-            append_to_buffer_realloc_if_necessary(buf, bufpos, bufs, linebuf, len);
+    int ret = 0;
+    while (ret == 0 && (len = get_line(contents->buf, &fbufpos, contents->bufs, line, TEMPLATE_LINE_MAXLEN)) != 0) {
+        if (len < 0) {
+            ret = -1;
+        } else if (line[0] != '{' || line[1] != '{') {
+            add_literal(t, line, len);
         } else {
             char *cmd;
-            char *tmp_arg;
-            if (parse_template_line(linebuf, &cmd, &tmp_arg) != 0) {
-                fprintf(stderr, "parse_template: Failed to parse template.\n");
-                exit(1);
-            }
-            if (strcmp(cmd, "include") == 0) {
-                tfun_include(buf, bufpos, bufs, tmp_arg);
+            char *arg;
+            if (parse_template_line(line, &cmd, &arg) != 0) {
+                fprintf(stderr, "compile_template: Failed to parse template.\n");
+                ret = -1;
+            } else if (strcmp(cmd, "include") == 0) {
+                ret = compile_include(t, arg);
             } else if (strcmp(cmd, "fun") == 0) {
-                memcpy(arg, tmp_arg, MAX_FUN_ARG_LEN);
-                return 1;
+                int fun;
+                for (fun = 0; funs[fun] && strcmp(funs[fun], arg) != 0; fun++);
+                if (funs[fun]) {
+                    add_instr(t, fun, 0, 0);
+                } else {
+                    fprintf(stderr, "compile_template: Invalid template command argument: %s.\n", arg);
+                    ret = -1;
+                }
             } else {
-                fprintf(stderr, "parse_template: Invalid template command.\n");
-                exit(1);
+                fprintf(stderr, "compile_template: Invalid template command.\n");
+                ret = -1;
             }
         }
     }
-    return 0;
+    resource_release(contents);
+
+    if (ret != 0) {
+        fprintf(stderr, "compile_template: Failed to compile %s.\n", r->filename);
+        free_compiled_template(t);
+        return NULL;
+    }
+    return t;
 }
 
-void
-template_thread(handler_t *h, long thread_id, const int headers_only)
+/*
+ * Splits a post part at its %ld and %s slots, which are filled with fields
+ * in order. Returns NULL if the slots don't match the fields.
+ */
+static compiled_template_t *
+compile_format(resource_t *r, const enum post_field *fields)
 {
-    const char *filename = "templates/thread.html";
+    compiled_template_t *t = new_compiled_template();
+    resource_contents_t *contents = resource_acquire(r);
+    char *f = contents->buf;
+    long start = 0;
+    int nfields = 0;
+    int ret = 0;
+
+    for (long i = 0; i < contents->bufs && ret == 0; i++) {
+        if (f[i] != '%') {
+            continue;
+        }
+        if (i > start) {
+            add_literal(t, &f[start], i - start);
+        }
+        if (f[i + 1] == '%') {
+            start = ++i;
+            continue;
+        }
+        int is_long = strncmp(&f[i + 1], "ld", 2) == 0;
+        if ((!is_long && f[i + 1] != 's') || fields[nfields] == POST_FIELD_END
+                || is_long != (fields[nfields] == POST_FIELD_POST_ID)) {
+            fprintf(stderr, "compile_format: Slot %d doesn't match its field.\n", nfields + 1);
+            ret = -1;
+            break;
+        }
+        add_instr(t, fields[nfields++], 0, 0);
+        i += is_long ? 2 : 1;
+        start = i + 1;
+    }
+    if (ret == 0 && fields[nfields] != POST_FIELD_END) {
+        fprintf(stderr, "compile_format: Fewer slots than fields.\n");
+        ret = -1;
+    }
+    if (ret == 0 && contents->bufs > start) {
+        add_literal(t, &f[start], contents->bufs - start);
+    }
+    resource_release(contents);
 
-    post_t *posts;
-    long nposts;
-    int ret = posts_get_by_thread_id(thread_id, &posts, &nposts);
     if (ret != 0) {
-        fprintf(stderr, "template_thread: posts_get_by_thread_id() failed.\n");
-        serve_error_404(h);
+        fprintf(stderr, "compile_format: Failed to compile %s.\n", r->filename);
+        free_compiled_template(t);
+        return NULL;
+    }
+    return t;
+}
+
+static compiled_template_t *
+acquire_template(compiled_template_t **template)
+{
+    pthread_mutex_lock(&templates_lock);
+    compiled_template_t *t = *template;
+    t->refs++;
+    pthread_mutex_unlock(&templates_lock);
+    return t;
+}
+
+static void
+release_template(compiled_template_t *t)
+{
+    pthread_mutex_lock(&templates_lock);
+    int unused = --t->refs == 0;
+    pthread_mutex_unlock(&templates_lock);
+
+    if (unused) {
+        free_compiled_template(t);
+    }
+}
+
+/* Publishes a template compiled again from r, unless it failed to compile. */
+static void
+replace_template(compiled_template_t **template, compiled_template_t *t, resource_t *r)
+{
+    if (!t) {
+        fprintf(stderr, "replace_template: Keeping the old version of %s.\n", r->filename);
         return;
     }
+    pthread_mutex_lock(&templates_lock);
+    compiled_template_t *old = *template;
+    *template = t;
+    pthread_mutex_unlock(&templates_lock);
+    release_template(old);
+}
 
-    char title[100];
-    snprintf(title, 100, "Thread no. %ld", thread_id);
+/* Any reloaded file may be a template or one of its includes, so everything is compiled again. */
+static void
+recompile_templates(void)
+{
+    replace_template(&thread_page, compile_template(thread_template, thread_funs), thread_template);
+    replace_template(&catalog_page, compile_template(catalog_template, catalog_funs), catalog_template);
+    replace_template(&post_in_thread_img_format, compile_format(post_in_thread_img_part, post_in_thread_img_fields), post_in_thread_img_part);
+    replace_template(&post_in_thread_noimg_format, compile_format(post_in_thread_noimg_part, post_in_thread_noimg_fields), post_in_thread_noimg_part);
+    replace_template(&post_in_catalog_format, compile_format(post_in_catalog_part, post_in_catalog_fields), post_in_catalog_part);
+    forum_invalidate_page_caches();
+}
 
-    long bufs = 4 * 1024 + nposts * 1024;
-    if (bufs > MAX_RESP_SIZE_1) {
-        fprintf(stderr, "template_thread: Buffer size would exceed MAX_RESP_SIZE_1.\n");
+void
+templating_init(void)
+{
+    thread_template = resource_cache_resolve("templates/thread.html");
+    catalog_template = resource_cache_resolve("templates/catalog.html");
+    new_post_form_part = resource_cache_resolve("templates/parts/new_post_form.html");
+    post_in_thread_img_part = resource_cache_resolve("templates/parts/post_in_thread_img.html");
+    post_in_thread_noimg_part = resource_cache_resolve("templates/parts/post_in_thread_noimg.html");
+    post_in_catalog_part = resource_cache_resolve("templates/parts/post_in_catalog.html");
+    no_threads_active_part = resource_cache_resolve("templates/parts/no_threads_active.html");
+
+    thread_page = compile_template(thread_template, thread_funs);
+    catalog_page = compile_template(catalog_template, catalog_funs);
+    post_in_thread_img_format = compile_format(post_in_thread_img_part, post_in_thread_img_fields);
+    post_in_thread_noimg_format = compile_format(post_in_thread_noimg_part, post_in_thread_noimg_fields);
+    post_in_catalog_format = compile_format(post_in_catalog_part, post_in_catalog_fields);
+    if (!thread_page || !catalog_page || !post_in_thread_img_format || !post_in_thread_noimg_format || !post_in_catalog_format) {
         exit(1);
     }
+    resource_cache_on_reload(recompile_templates);
+}
+
+/* Returns a string field of the post. thread is only needed for the subject. */
+static const char *
+post_field_string(enum post_field field, post_t *p, thread_t *thread, long *len)
+{
+    switch (field) {
+        case POST_FIELD_NAME: *len = p->name_len; return p->name;
+        case POST_FIELD_TIMESTAMP: *len = p->timestamp_len; return p->timestamp;
+        case POST_FIELD_FILENAME: *len = p->filename_len; return p->filename;
+        case POST_FIELD_COMMENT: *len = p->comment_len; return p->comment;
+        case POST_FIELD_SUBJECT: *len = thread->subject_len; return thread->subject;
+        default: *len = 0; return NULL;
+    }
+}
+
+/*
+ * Appends post p formatted with a compiled post part, leaving room for a
+ * newline after it. The size is known before anything is written, so the
+ * buffer grows at most once per post.
+ */
+static void
+format_post(char **buf, long *bufpos, long *bufs, compiled_template_t *format, post_t *p, thread_t *thread)
+{
+    long len = format->textpos + 1;
+    for (int i = 0; i < format->ninstrs; i++) {
+        int fun = format->instrs[i].fun;
+        if (fun == POST_FIELD_POST_ID) {
+            len += LONG_FORMAT_MAXLEN;
+        } else if (fun != TEMPLATE_LITERAL) {
+            long flen;
+            post_field_string(fun, p, thread, &flen);
+            len += flen;
+        }
+    }
+
+    if (*bufpos + len > *bufs) {
+        long newsize = *bufs * 2;
+        while (*bufpos + len > newsize) {
+            newsize *= 2;
+        }
+        if (newsize >= MAX_RESP_SIZE_1) {
+            fprintf(stderr, "format_post: Buffer size would exceed MAX_RESP_SIZE_1.\n");
+            exit(1);
+        }
+        char *newbuf = realloc(*buf, newsize);
+        if (!newbuf) {
+            fprintf(stderr, "format_post: realloc() failed.\n");
+            exit(1);
+        }
+        *buf = newbuf;
+        *bufs = newsize;
+    }
+
+    char *out = &(*buf)[*bufpos];
+    for (int i = 0; i < format->ninstrs; i++) {
+        template_instr_t *in = &format->instrs[i];
+        if (in->fun == TEMPLATE_LITERAL) {
+            memcpy(out, &format->text[in->pos], in->len);
+            out += in->len;
+        } else if (in->fun == POST_FIELD_POST_ID) {
+            out += format_long(out, p->post_id);
+        } else {
+            long flen;
+            const char *str = post_field_string(in->fun, p, thread, &flen);
+            memcpy(out, str, flen);
+            out += flen;
+        }
+    }
+    *bufpos = out - *buf;
+}
+
+/* Returns the cached fragment in slot with a reference held, rendering post p into it if the slot is empty. */
+static page_cache_entry_t *
+cached_fragment(page_cache_entry_t **slot, compiled_template_t *format, post_t *p, thread_t *thread)
+{
+    page_cache_entry_t *fragment = page_cache_get(slot);
+    if (fragment) {
+        return fragment;
+    }
+
+    long bufs = 1024;
+    long bufpos = 0;
     char *buf = malloc(bufs);
     if (!buf) {
-        fprintf(stderr, "template_thread: malloc() failed.\n");
+        fprintf(stderr, "cached_fragment: malloc() failed.\n");
         exit(1);
     }
-    long bufpos = 0;
-    char *fbuf;
-    long fbufpos = 0;
-    long fbufs;
-    resource_cache_get_file_buffer(filename, &fbuf, &fbufs);
+    format_post(&buf, &bufpos, &bufs, format, p, thread);
+    buf[bufpos++] = '\n';
 
-    while (1) {
-        char arg[MAX_FUN_ARG_LEN];
-        int ret = parse_template(fbuf, &fbufpos, fbufs, &buf, &bufpos, &bufs, arg);
-        if (ret == 0) {
-            break;
-        }
-        if (strcmp(arg, "title") == 0) {
-            tfun_title(&buf, &bufpos, &bufs, title);
-        } else if (strcmp(arg, "new_post_form") == 0) {
-            tfun_new_post_form(&buf, &bufpos, &bufs, thread_id);
-        } else if (strcmp(arg, "posts_in_thread") == 0) {
-            tfun_posts_in_thread(&buf, &bufpos, &bufs, posts, nposts);
-        } else {
-            fprintf(stderr, "template_thread: Invalid template command argument: %s.\n", arg);
+    fragment = page_cache_new_entry(buf, bufpos);
+    page_cache_put(slot, fragment);
+    return fragment;
+}
+
+/*
+ * What a page response refers to while it's being sent: its compiled
+ * template, the cached fragments it's made of and the parts rendered for it
+ * alone.
+ */
+typedef struct {
+    compiled_template_t *page;
+    resource_contents_t *contents; /* Part sent as is, if any. */
+    char *buf;
+    long bufpos;
+    long bufs;
+    long nfragments;
+    page_cache_entry_t *fragments[];
+} page_response_t;
+
+static page_response_t *
+new_page_response(compiled_template_t *page, long maxfragments, long bufs)
+{
+    page_response_t *resp = calloc(1, sizeof(page_response_t) + maxfragments * sizeof(page_cache_entry_t *));
+    if (!resp) {
+        fprintf(stderr, "new_page_response: calloc() failed.\n");
+        exit(1);
+    }
+    resp->page = page;
+    if (bufs > 0) {
+        resp->buf = malloc(bufs);
+        if (!resp->buf) {
+            fprintf(stderr, "new_page_response: malloc() failed.\n");
             exit(1);
         }
+        resp->bufs = bufs;
     }
+    return resp;
+}
 
-    if (headers_only) {
-        serve_html_file_from_buffer(h, NULL, bufpos);
-        free(buf);
-    } else {
-        serve_html_file_from_buffer(h, buf, bufpos);
+static void
+release_page_response(void *arg)
+{
+    page_response_t *resp = arg;
+    for (long i = 0; i < resp->nfragments; i++) {
+        page_cache_release(resp->fragments[i]);
+    }
+    if (resp->contents) {
+        resource_release(resp->contents);
+    }
+    release_template(resp->page);
+    free(resp->buf);
+    free(resp);
+}
+
+static void
+add_iov(struct iovec *iov, int *niov, char *buf, long len)
+{
+    iov[*niov].iov_base = buf;
+    iov[*niov].iov_len = len;
+    (*niov)++;
+}
+
+static int
+count_slots(compiled_template_t *page, int fun)
+{
+    int n = 0;
+    for (int i = 0; i < page->ninstrs; i++) {
+        if (page->instrs[i].fun == fun) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Assembles the page of thread from the literal slices of the page, its title
+ * and form and the fragments of the visible posts. A post is rendered once,
+ * its fragment is only dropped when the post is hidden or deleted or the
+ * templates change, so a page is mostly copied together. The title and form
+ * are rendered before anything refers to the buffer, so it can grow to fit
+ * whatever the form part was edited into.
+ */
+static page_cache_entry_t *
+render_thread_page(thread_t *thread)
+{
+    post_t *posts = thread->posts;
+    long nposts = thread->nposts;
+
+    char title[100];
+    snprintf(title, 100, "Thread no. %ld", thread->thread_id);
+
+    compiled_template_t *page = acquire_template(&thread_page);
+    long maxfragments = count_slots(page, THREAD_FUN_POSTS_IN_THREAD) * nposts;
+    page_response_t *resp = new_page_response(page, maxfragments, 4 * 1024);
+    tfun_title(&resp->buf, &resp->bufpos, &resp->bufs, title);
+    long title_len = resp->bufpos;
+    tfun_new_post_form(&resp->buf, &resp->bufpos, &resp->bufs, thread->thread_id);
+    long form_len = resp->bufpos - title_len;
+    struct iovec *iov = malloc((page->ninstrs + maxfragments) * sizeof(struct iovec));
+    if (!iov) {
+        fprintf(stderr, "render_thread_page: malloc() failed.\n");
+        exit(1);
+    }
+    int niov = 0;
+    compiled_template_t *img = acquire_template(&post_in_thread_img_format);
+    compiled_template_t *noimg = acquire_template(&post_in_thread_noimg_format);
+
+    for (int i = 0; i < page->ninstrs; i++) {
+        template_instr_t *in = &page->instrs[i];
+        switch (in->fun) {
+            case TEMPLATE_LITERAL:
+                add_iov(iov, &niov, &page->text[in->pos], in->len);
+                break;
+            case THREAD_FUN_TITLE:
+                add_iov(iov, &niov, resp->buf, title_len);
+                break;
+            case THREAD_FUN_NEW_POST_FORM:
+                add_iov(iov, &niov, &resp->buf[title_len], form_len);
+                break;
+            case THREAD_FUN_POSTS_IN_THREAD:
+                for (long j = 0; j < nposts; j++) {
+                    post_t *p = &posts[j];
+                    if (p->hidden) {
+                        continue;
+                    }
+                    page_cache_entry_t *fragment = cached_fragment(&p->fragment, *p->filename ? img : noimg, p, NULL);
+                    resp->fragments[resp->nfragments++] = fragment;
+                    add_iov(iov, &niov, fragment->body, fragment->body_size);
+                }
+                break;
+        }
+    }
+    release_template(img);
+    release_template(noimg);
+
+    long size = 0;
+    for (int i = 0; i < niov; i++) {
+        size += iov[i].iov_len;
+    }
+    char *body = malloc(size > 0 ? size : 1);
+    if (!body) {
+        fprintf(stderr, "render_thread_page: malloc() failed.\n");
+        exit(1);
+    }
+    long pos = 0;
+    for (int i = 0; i < niov; i++) {
+        memcpy(&body[pos], iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    free(iov);
+    release_page_response(resp);
+    return page_cache_new_entry(body, size);
+}
+
+static void
+release_page_cache_entry(void *arg)
+{
+    page_cache_release(arg);
+}
+
+/*
+ * A thread page is sent by reference from the copy kept with the thread, so
+ * serving it only takes one reference. It's assembled again after the
+ * thread changes or the templates are reloaded.
+ */
+void
+template_thread(handler_t *h, long thread_id, const int headers_only)
+{
+    forum_read_lock();
+    thread_t *thread = thread_get_by_id(thread_id);
+    if (!thread) {
+        forum_read_unlock();
+        fprintf(stderr, "template_thread: Thread not found.\n");
+        serve_error_404(h);
+        return;
+    }
+    page_cache_entry_t *page = page_cache_get(&thread->page);
+    if (!page) {
+        /* Stored before the read lock is released, so it can't outlive a change made meanwhile. */
+        page = render_thread_page(thread);
+        page_cache_put(&thread->page, page);
     }
+    forum_read_unlock();
+
+    struct iovec iov = { .iov_base = page->body, .iov_len = page->body_size };
+    serve_html_iovec(h, &iov, 1, headers_only, release_page_cache_entry, page);
 }
 
+/*
+ * The catalog is sent as the literal slices of the page and the card of
+ * every thread, all by reference. Cards are rendered once per thread and
+ * only dropped when the thread is deleted or the templates change.
+ */
 void
 template_catalog(handler_t *h, const int headers_only)
 {
-    const char *filename = "templates/catalog.html";
-
     thread_t *threads;
     long nthreads;
+    forum_read_lock();
     threads_get(&threads, &nthreads);
 
-    long bufs = 4 * 1024 + nthreads * 1024;
-    if (bufs > MAX_RESP_SIZE_1) {
-        fprintf(stderr, "template_catalog: Buffer size would exceed MAX_RESP_SIZE_1.\n");
-        exit(1);
-    }
-    char *buf = malloc(bufs);
-    if (!buf) {
+    compiled_template_t *page = acquire_template(&catalog_page);
+    int nslots = count_slots(page, CATALOG_FUN_POSTS_IN_CATALOG);
+    page_response_t *resp = new_page_response(page, nslots * nthreads, 0);
+    struct iovec *iov = malloc((page->ninstrs + nslots * (nthreads + 2)) * sizeof(struct iovec));
+    if (!iov) {
         fprintf(stderr, "template_catalog: malloc() failed.\n");
         exit(1);
     }
-    long bufpos = 0;
-    char *fbuf;
-    long fbufpos = 0;
-    long fbufs;
-    resource_cache_get_file_buffer(filename, &fbuf, &fbufs);
+    int niov = 0;
+    compiled_template_t *format = acquire_template(&post_in_catalog_format);
 
-    while (1) {
-        char arg[MAX_FUN_ARG_LEN];
-        int ret = parse_template(fbuf, &fbufpos, fbufs, &buf, &bufpos, &bufs, arg);
-        if (ret == 0) {
-            break;
-        }
-        if (strcmp(arg, "posts_in_catalog") == 0) {
-            if (nthreads > 0) {
-                tfun_posts_in_catalog(&buf, &bufpos, &bufs, threads, nthreads);
-            } else {
-                tfun_include(&buf, &bufpos, &bufs, "no_threads_active.html");
-            }
-        } else {
-            fprintf(stderr, "template_catalog: Invalid template command argument: %s.\n", arg);
-            exit(1);
+    for (int i = 0; i < page->ninstrs; i++) {
+        template_instr_t *in = &page->instrs[i];
+        switch (in->fun) {
+            case TEMPLATE_LITERAL:
+                add_iov(iov, &niov, &page->text[in->pos], in->len);
+                break;
+            case CATALOG_FUN_POSTS_IN_CATALOG:
+                for (long j = 0; j < nthreads; j++) {
+                    thread_t *t = &threads[j];
+                    page_cache_entry_t *card = cached_fragment(&t->card, format, &t->posts[0], t);
+                    resp->fragments[resp->nfragments++] = card;
+                    add_iov(iov, &niov, card->body, card->body_size);
+                }
+                if (nthreads == 0) {
+                    if (!resp->contents) {
+                        resp->contents = resource_acquire(no_threads_active_part);
+                    }
+                    add_iov(iov, &niov, resp->contents->buf, resp->contents->bufs);
+                    add_iov(iov, &niov, "\n", 1);
+                }
+                break;
         }
     }
+    forum_read_unlock();
+    release_template(format);
 
-    if (headers_only) {
-        serve_html_file_from_buffer(h, NULL, bufpos);
-        free(buf);
-    } else {
-        serve_html_file_from_buffer(h, buf, bufpos);
-    }
+    serve_html_iovec(h, iov, niov, headers_only, release_page_response, resp);
+    free(iov);
 }
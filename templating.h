@@ -1,2 +1,3 @@
+void templating_init(void);
 void template_thread(handler_t *h, long thread_id, const int headers_only);
 void template_catalog(handler_t *h, const int headers_only);
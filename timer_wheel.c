@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_EXPIRED_LIST (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+#define TIMER_WHEEL_NO_LIST -1
+
+/*
+ * Hierarchical timer wheel. Time is counted in ticks, level 0 has one slot per
+ * tick and every level above has slots that are TIMER_WHEEL_SLOTS times wider.
+ * A timer is kept on the level of the highest tick digit in which its expiry
+ * differs from the current tick, so when the current tick's digit on a level
+ * changes, the slot for the new digit holds exactly the timers that now belong
+ * on a lower level and they are moved down. Timers reaching level 0 expire when
+ * the wheel passes their slot.
+ *
+ * Timers are identified by token, and the nodes live in an array indexed by it,
+ * so they stay valid when the owner's table is reallocated. Expired timers are
+ * moved to a separate list and handed out one by one, so the owner may cancel
+ * or schedule timers while processing them.
+ */
+struct timer_node {
+    long expires; /* In ticks. */
+    long prev;
+    long next;
+    int list; /* Slot index, TIMER_WHEEL_EXPIRED_LIST or TIMER_WHEEL_NO_LIST. */
+};
+
+struct timer_wheel {
+    long now; /* Last processed tick. */
+    struct timer_node *nodes;
+    long nodes_allocated;
+    long heads[TIMER_WHEEL_EXPIRED_LIST + 1];
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; /* Bit per non-empty slot. */
+    long count; /* Timers in the wheel, not counting expired ones. */
+};
+
+timer_wheel_t *
+timer_wheel_create(long now_ms)
+{
+    timer_wheel_t *w = calloc(1, sizeof(timer_wheel_t));
+    if (!w) {
+        fprintf(stderr, "timer_wheel_create: calloc() failed.\n");
+        exit(1);
+    }
+    w->now = now_ms / TIMER_WHEEL_TICK_MS;
+    for (int i = 0; i <= TIMER_WHEEL_EXPIRED_LIST; i++) {
+        w->heads[i] = -1;
+    }
+    return w;
+}
+
+/* Makes tokens up to ntimers - 1 usable. */
+void
+timer_wheel_reserve(timer_wheel_t *w, long ntimers)
+{
+    if (ntimers <= w->nodes_allocated) {
+        return;
+    }
+    struct timer_node *tmp = realloc(w->nodes, ntimers * sizeof(struct timer_node));
+    if (!tmp) {
+        fprintf(stderr, "timer_wheel_reserve: realloc() failed.\n");
+        exit(1);
+    }
+    for (long i = w->nodes_allocated; i < ntimers; i++) {
+        tmp[i].list = TIMER_WHEEL_NO_LIST;
+    }
+    w->nodes = tmp;
+    w->nodes_allocated = ntimers;
+}
+
+static void
+list_push(timer_wheel_t *w, int list, long token)
+{
+    struct timer_node *node = &w->nodes[token];
+    node->list = list;
+    node->prev = -1;
+    node->next = w->heads[list];
+    if (node->next >= 0) {
+        w->nodes[node->next].prev = token;
+    }
+    w->heads[list] = token;
+
+    if (list != TIMER_WHEEL_EXPIRED_LIST) {
+        w->occupied[list / TIMER_WHEEL_SLOTS] |= (uint64_t)1 << (list % TIMER_WHEEL_SLOTS);
+        w->count++;
+    }
+}
+
+static void
+list_remove(timer_wheel_t *w, long token)
+{
+    struct timer_node *node = &w->nodes[token];
+    int list = node->list;
+    if (node->prev >= 0) {
+        w->nodes[node->prev].next = node->next;
+    } else {
+        w->heads[list] = node->next;
+    }
+    if (node->next >= 0) {
+        w->nodes[node->next].prev = node->prev;
+    }
+    node->list = TIMER_WHEEL_NO_LIST;
+
+    if (list != TIMER_WHEEL_EXPIRED_LIST) {
+        if (w->heads[list] < 0) {
+            w->occupied[list / TIMER_WHEEL_SLOTS] &= ~((uint64_t)1 << (list % TIMER_WHEEL_SLOTS));
+        }
+        w->count--;
+    }
+}
+
+static void
+place(timer_wheel_t *w, long token)
+{
+    long expires = w->nodes[token].expires;
+    if (expires <= w->now) {
+        list_push(w, TIMER_WHEEL_EXPIRED_LIST, token);
+        return;
+    }
+
+    long diff = expires ^ w->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && (diff >> (TIMER_WHEEL_SLOT_BITS * (level + 1))) != 0) {
+        level++;
+    }
+
+    long slot;
+    if ((diff >> (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) != 0) {
+        /* Beyond the range of the wheel, park it in the top level slot that is reached last and place it again from there. */
+        slot = ((w->now >> (TIMER_WHEEL_SLOT_BITS * level)) - 1) & TIMER_WHEEL_SLOT_MASK;
+    } else {
+        slot = (expires >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+    }
+    list_push(w, level * TIMER_WHEEL_SLOTS + slot, token);
+}
+
+/* Schedules the timer for token, replacing the one it already had. */
+void
+timer_wheel_schedule(timer_wheel_t *w, long token, long expires_ms)
+{
+    if (token < 0 || token >= w->nodes_allocated) {
+        fprintf(stderr, "timer_wheel_schedule: Invalid token %ld.\n", token);
+        exit(1);
+    }
+    if (w->nodes[token].list != TIMER_WHEEL_NO_LIST) {
+        list_remove(w, token);
+    }
+    /* Rounded up, so a timer never fires early. */
+    w->nodes[token].expires = (expires_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    place(w, token);
+}
+
+void
+timer_wheel_cancel(timer_wheel_t *w, long token)
+{
+    if (token >= 0 && token < w->nodes_allocated && w->nodes[token].list != TIMER_WHEEL_NO_LIST) {
+        list_remove(w, token);
+    }
+}
+
+/* Moves every timer in the slot one level down, or to the expired list. */
+static void
+cascade(timer_wheel_t *w, int list)
+{
+    while (w->heads[list] >= 0) {
+        long token = w->heads[list];
+        list_remove(w, token);
+        place(w, token);
+    }
+}
+
+/* Processes the ticks up to now_ms, timers that expired are returned by timer_wheel_next_expired(). */
+void
+timer_wheel_advance(timer_wheel_t *w, long now_ms)
+{
+    long target = now_ms / TIMER_WHEEL_TICK_MS;
+    while (w->now < target) {
+        if (w->count == 0) {
+            w->now = target;
+            break;
+        }
+        w->now++;
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            long low_bits = w->now & (((long)1 << (TIMER_WHEEL_SLOT_BITS * level)) - 1);
+            if (low_bits == 0) {
+                long slot = (w->now >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+                cascade(w, level * TIMER_WHEEL_SLOTS + slot);
+            }
+        }
+        cascade(w, w->now & TIMER_WHEEL_SLOT_MASK);
+    }
+}
+
+/* Returns 1 and removes one expired timer, 0 when there are none left. */
+int
+timer_wheel_next_expired(timer_wheel_t *w, long *token)
+{
+    long t = w->heads[TIMER_WHEEL_EXPIRED_LIST];
+    if (t < 0) {
+        return 0;
+    }
+    list_remove(w, t);
+    *token = t;
+    return 1;
+}
+
+/* Returns the poll timeout in ms until the wheel has to be advanced again, -1 if there are no timers. */
+int
+timer_wheel_timeout(timer_wheel_t *w, long now_ms)
+{
+    if (w->heads[TIMER_WHEEL_EXPIRED_LIST] >= 0) {
+        return 0;
+    }
+    if (w->count == 0) {
+        return -1;
+    }
+
+    /*
+     * The nearest non-empty slot on each level is the next point at which timers
+     * expire or move down. Slots on a level are only ever occupied ahead of the
+     * current digit, so the distance is counted from the slot after it.
+     */
+    long next = LONG_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t bits = w->occupied[level];
+        if (!bits) {
+            continue;
+        }
+        int shift = TIMER_WHEEL_SLOT_BITS * level;
+        int rot = ((w->now >> shift) + 1) & TIMER_WHEEL_SLOT_MASK;
+        if (rot) {
+            bits = (bits >> rot) | (bits << (TIMER_WHEEL_SLOTS - rot));
+        }
+        long distance = __builtin_ctzll(bits) + 1;
+        long tick = ((w->now >> shift) + distance) << shift;
+        if (tick < next) {
+            next = tick;
+        }
+    }
+
+    long timeout = next * TIMER_WHEEL_TICK_MS - now_ms;
+    if (timeout < 0) {
+        return 0;
+    }
+    return (timeout > INT_MAX) ? INT_MAX : timeout;
+}
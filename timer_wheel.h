@@ -0,0 +1,9 @@
+typedef struct timer_wheel timer_wheel_t;
+
+timer_wheel_t *timer_wheel_create(long now_ms);
+void timer_wheel_reserve(timer_wheel_t *w, long ntimers);
+void timer_wheel_schedule(timer_wheel_t *w, long token, long expires_ms);
+void timer_wheel_cancel(timer_wheel_t *w, long token);
+void timer_wheel_advance(timer_wheel_t *w, long now_ms);
+int timer_wheel_next_expired(timer_wheel_t *w, long *token);
+int timer_wheel_timeout(timer_wheel_t *w, long now_ms);
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "upload_cache.h"
+
+#define UPLOAD_CACHE_BUCKETS 1024
+
+/*
+ * Uploaded files kept in memory together with their response headers, up to
+ * UPLOAD_CACHE_BUDGET bytes. The least recently used entries are evicted
+ * first. Responses hold a reference to the entry they are sending, so an
+ * entry that is evicted or invalidated while in use is only unlinked, and
+ * freed when the last response using it is done.
+ *
+ * generation is bumped by every invalidation. A file that was read from disk
+ * before an invalidation isn't inserted afterwards, so a file that was just
+ * deleted can't come back into the cache.
+ */
+static upload_cache_entry_t *table[UPLOAD_CACHE_BUCKETS];
+static upload_cache_entry_t *lru_head; /* Most recently used. */
+static upload_cache_entry_t *lru_tail;
+static long cached_bytes;
+static unsigned long generation;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long
+hash_path(const char *path)
+{
+    unsigned long h = 5381;
+    while (*path) {
+        h = h * 33 + (unsigned char)*path++;
+    }
+    return h % UPLOAD_CACHE_BUCKETS;
+}
+
+static long
+entry_size(upload_cache_entry_t *entry)
+{
+    return sizeof(upload_cache_entry_t) + entry->body_size;
+}
+
+static void
+lru_unlink(upload_cache_entry_t *entry)
+{
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void
+lru_push_front(upload_cache_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+static upload_cache_entry_t *
+lookup(const char *path)
+{
+    for (upload_cache_entry_t *e = table[hash_path(path)]; e; e = e->hash_next) {
+        if (strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+free_entry(upload_cache_entry_t *entry)
+{
+    free(entry->body);
+    free(entry);
+}
+
+/* Takes the entry out of the table, it's freed now or by the release of its last reference. */
+static void
+remove_entry(upload_cache_entry_t *entry)
+{
+    upload_cache_entry_t **pp = &table[hash_path(entry->path)];
+    while (*pp != entry) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = entry->hash_next;
+    lru_unlink(entry);
+    cached_bytes -= entry_size(entry);
+    entry->cached = 0;
+
+    if (entry->refcount == 0) {
+        free_entry(entry);
+    }
+}
+
+/*
+ * Returns the cached entry for path with a reference held, which must be
+ * dropped with upload_cache_release(). On a miss returns NULL and sets
+ * generation, to be passed to upload_cache_insert() with the loaded file.
+ */
+upload_cache_entry_t *
+upload_cache_get(const char *path, unsigned long *gen)
+{
+    pthread_mutex_lock(&cache_lock);
+    upload_cache_entry_t *entry = lookup(path);
+    if (entry) {
+        entry->refcount++;
+        lru_unlink(entry);
+        lru_push_front(entry);
+    } else {
+        *gen = generation;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+}
+
+/* Returns a new entry that takes ownership of body, with one reference held by the caller. The caller fills in the headers. */
+upload_cache_entry_t *
+upload_cache_new_entry(const char *path, char *body, long body_size)
+{
+    int len = strlen(path);
+    if (len + 1 > UPLOAD_CACHE_PATH_MAXLEN) {
+        return NULL;
+    }
+    upload_cache_entry_t *entry = calloc(1, sizeof(upload_cache_entry_t));
+    if (!entry) {
+        fprintf(stderr, "upload_cache_new_entry: calloc() failed.\n");
+        exit(1);
+    }
+    memcpy(entry->path, path, len + 1);
+    entry->body = body;
+    entry->body_size = body_size;
+    entry->refcount = 1;
+    return entry;
+}
+
+/*
+ * Adds a new entry to the cache, evicting the least recently used entries to
+ * stay within the budget. If another thread cached the same file first, the
+ * new entry is freed and the existing one is returned with a reference held
+ * instead. Entries that aren't inserted stay usable by the caller.
+ */
+upload_cache_entry_t *
+upload_cache_insert(upload_cache_entry_t *entry, unsigned long gen)
+{
+    pthread_mutex_lock(&cache_lock);
+
+    upload_cache_entry_t *existing = lookup(entry->path);
+    if (existing) {
+        existing->refcount++;
+        pthread_mutex_unlock(&cache_lock);
+        free_entry(entry);
+        return existing;
+    }
+
+    long size = entry_size(entry);
+    if (gen != generation || size > UPLOAD_CACHE_BUDGET) {
+        pthread_mutex_unlock(&cache_lock);
+        return entry;
+    }
+
+    while (cached_bytes + size > UPLOAD_CACHE_BUDGET && lru_tail) {
+        remove_entry(lru_tail);
+    }
+
+    unsigned long h = hash_path(entry->path);
+    entry->hash_next = table[h];
+    table[h] = entry;
+    lru_push_front(entry);
+    cached_bytes += size;
+    entry->cached = 1;
+
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+}
+
+void
+upload_cache_release(upload_cache_entry_t *entry)
+{
+    pthread_mutex_lock(&cache_lock);
+    entry->refcount--;
+    int unused = entry->refcount == 0 && !entry->cached;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (unused) {
+        free_entry(entry);
+    }
+}
+
+/* Called when the file at path was moved or deleted. */
+void
+upload_cache_invalidate(const char *path)
+{
+    pthread_mutex_lock(&cache_lock);
+    generation++;
+    upload_cache_entry_t *entry = lookup(path);
+    if (entry) {
+        remove_entry(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,22 @@
+#define UPLOAD_CACHE_PATH_MAXLEN 128
+#define UPLOAD_CACHE_HEADERS_MAXSIZE 256
+
+typedef struct upload_cache_entry {
+    char path[UPLOAD_CACHE_PATH_MAXLEN];
+    char *body;
+    long body_size;
+    char headers[2][UPLOAD_CACHE_HEADERS_MAXSIZE]; /* Complete response headers, indexed by keep_alive. */
+    long headers_len[2];
+
+    int refcount;
+    int cached; /* Reachable through the table. Entries that were evicted are freed with their last reference. */
+    struct upload_cache_entry *hash_next;
+    struct upload_cache_entry *lru_prev;
+    struct upload_cache_entry *lru_next;
+} upload_cache_entry_t;
+
+upload_cache_entry_t *upload_cache_get(const char *path, unsigned long *generation);
+upload_cache_entry_t *upload_cache_new_entry(const char *path, char *body, long body_size);
+upload_cache_entry_t *upload_cache_insert(upload_cache_entry_t *entry, unsigned long generation);
+void upload_cache_release(upload_cache_entry_t *entry);
+void upload_cache_invalidate(const char *path);
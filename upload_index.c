@@ -0,0 +1,408 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "upload_index.h"
+#include "upload_cache.h"
+#include "multipart.h"
+
+#define UPLOAD_INDEX_BUCKETS 4096
+
+/*
+ * Names of the files that can be served from the uploads directory, with
+ * their size and mime type. Built by scanning the directory at startup and
+ * kept up to date as posts are created and deleted, so requests for files
+ * that don't exist are answered without touching the filesystem.
+ *
+ * Uploads are named by their content, so posts with identical files share
+ * one. refs counts the posts using a file. When the last of them is deleted
+ * the entry is only marked and queued, the reclaimer moves the file to the
+ * deleted directory later, in batches. Until then the entry is kept, so an
+ * identical upload takes the file back instead of storing it again. Files
+ * found at startup aren't used by any post.
+ *
+ * Files are only stored and moved away while holding file_lock, which lookups
+ * don't take, so requests for uploads aren't held up by the filesystem. The
+ * index lock is only taken around the table updates that follow.
+ */
+typedef struct upload_index_entry {
+    char name[UPLOAD_INDEX_NAME_MAXLEN];
+    long size;
+    const char *mime_type;
+    long refs;
+    int reclaim; /* No longer used, to be moved away. Not served. */
+    int queued; /* On the reclaim queue, which may outlive reclaim when the file is uploaded again. */
+    struct upload_index_entry *next;
+    struct upload_index_entry *reclaim_next;
+} upload_index_entry_t;
+
+static upload_index_entry_t *table[UPLOAD_INDEX_BUCKETS];
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *upload_dir;
+static upload_index_entry_t *reclaim_head;
+static upload_index_entry_t *reclaim_tail;
+static long reclaim_pending;
+
+static unsigned long
+hash_name(const char *name)
+{
+    unsigned long h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h % UPLOAD_INDEX_BUCKETS;
+}
+
+/* Returns the mime type the file is served with, NULL if it isn't servable. */
+static const char *
+mime_type_from_filename(const char *filename)
+{
+    int len = strlen(filename);
+    if (len < 5 || len >= UPLOAD_INDEX_NAME_MAXLEN) {
+        return NULL;
+    }
+    if (strcmp(&filename[len - 4], ".png") == 0) {
+        return "image/png";
+    } else if (strcmp(&filename[len - 4], ".jpg") == 0) {
+        return "image/jpeg";
+    }
+    return NULL;
+}
+
+static upload_index_entry_t *
+lookup(const char *filename)
+{
+    for (upload_index_entry_t *entry = table[hash_name(filename)]; entry; entry = entry->next) {
+        if (strcmp(entry->name, filename) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Must be called with the write lock held. Returns NULL for files that can't be served. */
+static upload_index_entry_t *
+add_entry(const char *filename, long size)
+{
+    const char *mime_type = mime_type_from_filename(filename);
+    if (!mime_type) {
+        return NULL;
+    }
+    upload_index_entry_t *entry = malloc(sizeof(upload_index_entry_t));
+    if (!entry) {
+        fprintf(stderr, "add_entry: malloc() failed.\n");
+        exit(1);
+    }
+    strcpy(entry->name, filename);
+    entry->size = size;
+    entry->mime_type = mime_type;
+    entry->refs = 0;
+    entry->reclaim = 0;
+    entry->queued = 0;
+    unsigned long h = hash_name(filename);
+    entry->next = table[h];
+    table[h] = entry;
+    return entry;
+}
+
+static void
+remove_entry(upload_index_entry_t *entry)
+{
+    upload_index_entry_t **pp = &table[hash_name(entry->name)];
+    while (*pp != entry) {
+        pp = &(*pp)->next;
+    }
+    *pp = entry->next;
+    free(entry);
+}
+
+static void
+write_lock(void)
+{
+    if (pthread_rwlock_wrlock(&index_lock) != 0) {
+        fprintf(stderr, "upload_index: pthread_rwlock_wrlock() failed.\n");
+        exit(1);
+    }
+}
+
+/*
+ * Stores the uploaded file of part as filename and takes a reference to it.
+ * If an identical file is already stored, the part's temporary file is left
+ * for multipart_free() to remove. Returns 0 on success, on failure the
+ * temporary file is left as well.
+ */
+int
+upload_index_store(multipart_part_t *part, const char *filename)
+{
+    if (!mime_type_from_filename(filename)) {
+        fprintf(stderr, "upload_index_store: Invalid filename %s.\n", filename);
+        return 1;
+    }
+
+    pthread_mutex_lock(&file_lock);
+    write_lock();
+    upload_index_entry_t *entry = lookup(filename);
+    if (entry) {
+        /* A file waiting to be moved away is still in place and is used again. */
+        entry->reclaim = 0;
+        entry->refs++;
+        pthread_rwlock_unlock(&index_lock);
+        pthread_mutex_unlock(&file_lock);
+        return 0;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    /* Files are sharded into subdirectories, which are created on first use. */
+    const char *slash = strrchr(filename, '/');
+    if (slash) {
+        char dir[256];
+        int len = snprintf(dir, sizeof(dir), "%s/%.*s", upload_dir, (int)(slash - filename), filename);
+        if (len + 1 > (int)sizeof(dir)) {
+            fprintf(stderr, "upload_index_store: Path buffer too small.\n");
+            pthread_mutex_unlock(&file_lock);
+            return 1;
+        }
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            perror("upload_index_store: mkdir()");
+            pthread_mutex_unlock(&file_lock);
+            return 1;
+        }
+    }
+    if (multipart_save_file(part, upload_dir, filename) != 0) {
+        pthread_mutex_unlock(&file_lock);
+        return 1;
+    }
+
+    /* Nothing else adds entries while file_lock is held, so filename is still missing. */
+    write_lock();
+    entry = add_entry(filename, part->size);
+    entry->refs++;
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&file_lock);
+    return 0;
+}
+
+/*
+ * Drops a post's reference to filename. When it was the last one the file
+ * stops being served right away, and is queued to be moved to the deleted
+ * directory by upload_index_reclaim().
+ */
+void
+upload_index_unref(const char *filename)
+{
+    write_lock();
+    upload_index_entry_t *entry = lookup(filename);
+    if (!entry || entry->reclaim || --entry->refs > 0) {
+        pthread_rwlock_unlock(&index_lock);
+        return;
+    }
+    entry->reclaim = 1;
+    if (!entry->queued) {
+        entry->queued = 1;
+        entry->reclaim_next = NULL;
+        if (reclaim_tail) {
+            reclaim_tail->reclaim_next = entry;
+        } else {
+            reclaim_head = entry;
+        }
+        reclaim_tail = entry;
+        reclaim_pending++;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", upload_dir, filename);
+    upload_cache_invalidate(path);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+/* Moves the file of an entry that was taken out of the index to the deleted directory. Called with file_lock held. Returns 0 on success. */
+static int
+move_to_deleted(const char *name)
+{
+    const char *slash = strrchr(name, '/');
+    const char *basename = slash ? slash + 1 : name;
+    char oldpath[256];
+    char newpath[256];
+    int oldlen = snprintf(oldpath, sizeof(oldpath), "%s/%s", upload_dir, name);
+    int newlen = snprintf(newpath, sizeof(newpath), "%s/deleted/%s", upload_dir, basename);
+    if (oldlen + 1 > (int)sizeof(oldpath) || newlen + 1 > (int)sizeof(newpath)) {
+        fprintf(stderr, "move_to_deleted: Path buffer too small.\n");
+        return 1;
+    }
+    if (rename(oldpath, newpath) != 0) {
+        perror("move_to_deleted: rename()");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Moves up to max files queued by upload_index_unref() to the deleted
+ * directory. Their entries are taken out of the index in one batch under the
+ * write lock, the files are moved after it's released. Files that were
+ * uploaded again since they were queued stay. Returns the number of files
+ * moved and sets pending to the number still queued.
+ */
+long
+upload_index_reclaim(long max, long *pending)
+{
+    char (*names)[UPLOAD_INDEX_NAME_MAXLEN] = malloc(max * UPLOAD_INDEX_NAME_MAXLEN);
+    if (!names) {
+        fprintf(stderr, "upload_index_reclaim: malloc() failed.\n");
+        exit(1);
+    }
+
+    long ntaken = 0;
+    write_lock();
+    while (reclaim_head && ntaken < max) {
+        upload_index_entry_t *entry = reclaim_head;
+        reclaim_head = entry->reclaim_next;
+        if (!reclaim_head) {
+            reclaim_tail = NULL;
+        }
+        reclaim_pending--;
+        entry->queued = 0;
+        if (!entry->reclaim) {
+            continue;
+        }
+        strcpy(names[ntaken++], entry->name);
+        remove_entry(entry);
+    }
+    *pending = reclaim_pending;
+    pthread_rwlock_unlock(&index_lock);
+
+    long moved = 0;
+    for (long i = 0; i < ntaken; i++) {
+        /*
+         * An identical file uploaded since the entry was removed was stored
+         * in the same place, and is indexed again. It must stay.
+         */
+        pthread_mutex_lock(&file_lock);
+        if (pthread_rwlock_rdlock(&index_lock) != 0) {
+            fprintf(stderr, "upload_index_reclaim: pthread_rwlock_rdlock() failed.\n");
+            exit(1);
+        }
+        int stored_again = lookup(names[i]) != NULL;
+        pthread_rwlock_unlock(&index_lock);
+        if (!stored_again && move_to_deleted(names[i]) == 0) {
+            moved++;
+        }
+        pthread_mutex_unlock(&file_lock);
+    }
+    free(names);
+    return moved;
+}
+
+/* Removes files that were moved to the deleted directory more than retention_seconds ago. Returns the number removed. */
+long
+upload_index_purge_deleted(long retention_seconds)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/deleted", upload_dir);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "upload_index_purge_deleted: Failed to open directory %s.\n", path);
+        return 0;
+    }
+
+    /* rename() updates a file's ctime, so it tells when the file was moved. */
+    time_t cutoff = time(NULL) - retention_seconds;
+    long purged = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.') {
+            /* Like the file that keeps the directory in version control. */
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) || st.st_ctime > cutoff) {
+            continue;
+        }
+        if (unlinkat(dirfd(dir), de->d_name, 0) != 0) {
+            perror("upload_index_purge_deleted: unlinkat()");
+            continue;
+        }
+        purged++;
+    }
+    closedir(dir);
+    return purged;
+}
+
+/* Returns 0 and the file's size and mime type if filename is in the index, -1 otherwise. */
+int
+upload_index_lookup(const char *filename, long *size, const char **mime_type)
+{
+    if (pthread_rwlock_rdlock(&index_lock) != 0) {
+        fprintf(stderr, "upload_index_lookup: pthread_rwlock_rdlock() failed.\n");
+        exit(1);
+    }
+    int ret = -1;
+    upload_index_entry_t *entry = lookup(filename);
+    if (entry && !entry->reclaim) {
+        *size = entry->size;
+        *mime_type = entry->mime_type;
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return ret;
+}
+
+static int
+is_shard_name(const char *name)
+{
+    return strlen(name) == 2 && strchr("0123456789abcdef", name[0]) && strchr("0123456789abcdef", name[1]);
+}
+
+/* Adds the regular files in path, named prefix followed by the file's name, and scans shard subdirectories. */
+static void
+scan_directory(const char *path, const char *prefix)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "scan_directory: Failed to open directory %s.\n", path);
+        exit(1);
+    }
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) != 0) {
+            continue;
+        }
+        char name[UPLOAD_INDEX_NAME_MAXLEN];
+        int len = snprintf(name, sizeof(name), "%s%s", prefix, de->d_name);
+        if (len + 1 > (int)sizeof(name)) {
+            continue;
+        }
+        if (S_ISREG(st.st_mode)) {
+            add_entry(name, st.st_size);
+        } else if (S_ISDIR(st.st_mode) && !*prefix && is_shard_name(name)) {
+            char subpath[256];
+            if (snprintf(subpath, sizeof(subpath), "%s/%s", path, name) + 1 > (int)sizeof(subpath)) {
+                fprintf(stderr, "scan_directory: Path buffer too small.\n");
+                exit(1);
+            }
+            char subprefix[] = {name[0], name[1], '/', '\0'};
+            scan_directory(subpath, subprefix);
+        }
+    }
+    closedir(dir);
+}
+
+/* Builds the index from the files in directory, where uploads are stored from then on. */
+void
+upload_index_init(const char *directory)
+{
+    upload_dir = directory;
+    write_lock();
+    scan_directory(directory, "");
+    pthread_rwlock_unlock(&index_lock);
+}
@@ -0,0 +1,10 @@
+#define UPLOAD_INDEX_NAME_MAXLEN 64
+
+struct multipart_part;
+
+void upload_index_init(const char *directory);
+int upload_index_lookup(const char *filename, long *size, const char **mime_type);
+int upload_index_store(struct multipart_part *part, const char *filename);
+void upload_index_unref(const char *filename);
+long upload_index_reclaim(long max, long *pending);
+long upload_index_purge_deleted(long retention_seconds);
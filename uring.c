@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls.
+ *
+ * Operations are queued into the submission ring as they are prepared and
+ * handed to the kernel together by the next uring_submit_and_wait(), so one
+ * io_uring_enter() submits everything a loop iteration produced and waits for
+ * completions at the same time.
+ */
+struct uring {
+    int fd;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int to_submit;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/* Returns NULL if io_uring is not available or lacks a feature we rely on. */
+uring_t *
+uring_create(unsigned int entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0) {
+        perror("uring_create: io_uring_setup()");
+        return NULL;
+    }
+
+    const unsigned int required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((p.features & required) != required) {
+        fprintf(stderr, "uring_create: Kernel lacks required io_uring features.\n");
+        close(fd);
+        return NULL;
+    }
+
+    uring_t *u = calloc(1, sizeof(uring_t));
+    if (!u) {
+        fprintf(stderr, "uring_create: calloc() failed.\n");
+        exit(1);
+    }
+    u->fd = fd;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    u->ring_ptr = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->ring_ptr == MAP_FAILED) {
+        perror("uring_create: mmap()");
+        close(fd);
+        free(u);
+        return NULL;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        perror("uring_create: mmap()");
+        munmap(u->ring_ptr, u->ring_size);
+        close(fd);
+        free(u);
+        return NULL;
+    }
+
+    char *ring = u->ring_ptr;
+    u->sq_head = (unsigned int *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)(ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned int *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    return u;
+}
+
+static void
+uring_submit(uring_t *u, unsigned int min_complete, int timeout)
+{
+    unsigned int flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+
+    int ret = sys_io_uring_enter(u->fd, u->to_submit, min_complete, flags, argp, argsz);
+    if (ret < 0) {
+        if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN) {
+            return;
+        }
+        perror("uring_submit: io_uring_enter()");
+        exit(1);
+    }
+    u->to_submit -= ret;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(uring_t *u)
+{
+    unsigned int tail = *u->sq_tail;
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        /* Ring full, hand what we have to the kernel before queueing more. */
+        uring_submit(u, 0, -1);
+    }
+    unsigned int index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+static void
+uring_queue_sqe(uring_t *u)
+{
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+}
+
+void
+uring_prep_recv(uring_t *u, int fd, void *buf, unsigned int len, long token)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = (uint64_t)token;
+    uring_queue_sqe(u);
+}
+
+void
+uring_prep_writev(uring_t *u, int fd, const struct iovec *iov, int iovcnt, long token)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = iovcnt;
+    sqe->user_data = (uint64_t)token;
+    uring_queue_sqe(u);
+}
+
+void
+uring_prep_poll_add(uring_t *u, int fd, unsigned int poll_mask, long token)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = poll_mask;
+    sqe->user_data = (uint64_t)token;
+    uring_queue_sqe(u);
+}
+
+/* Cancels the operation submitted with target_token, the cancel itself completes with token. */
+void
+uring_prep_cancel(uring_t *u, long target_token, long token)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)target_token;
+    sqe->user_data = (uint64_t)token;
+    uring_queue_sqe(u);
+}
+
+/* Submits all queued operations and waits for at least one completion, or timeout ms if timeout >= 0. */
+void
+uring_submit_and_wait(uring_t *u, int timeout)
+{
+    if (*u->cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        /* Completions are already waiting, don't block. */
+        if (u->to_submit > 0) {
+            uring_submit(u, 0, -1);
+        }
+        return;
+    }
+    uring_submit(u, 1, timeout);
+}
+
+/* Returns 1 and the next completion's token and result, 0 when the completion ring is empty. */
+int
+uring_next_completion(uring_t *u, long *token, int *res)
+{
+    unsigned int head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    *token = (long)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
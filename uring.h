@@ -0,0 +1,13 @@
+struct iovec;
+
+typedef struct uring uring_t;
+
+uring_t *uring_create(unsigned int entries);
+
+void uring_prep_recv(uring_t *u, int fd, void *buf, unsigned int len, long token);
+void uring_prep_writev(uring_t *u, int fd, const struct iovec *iov, int iovcnt, long token);
+void uring_prep_poll_add(uring_t *u, int fd, unsigned int poll_mask, long token);
+void uring_prep_cancel(uring_t *u, long target_token, long token);
+
+void uring_submit_and_wait(uring_t *u, int timeout);
+int uring_next_completion(uring_t *u, long *token, int *res);
@@ -67,6 +67,31 @@ parse_long(long **l, char *str)
     }
 }
 
+/*
+ * Writes l in decimal to buf, which must have room for LONG_FORMAT_MAXLEN
+ * characters. Not null-terminated. Returns the number of characters written.
+ */
+int
+format_long(char *buf, long l)
+{
+    char tmp[LONG_FORMAT_MAXLEN];
+    int n = 0;
+    unsigned long u = (l < 0) ? -(unsigned long)l : (unsigned long)l;
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    int len = 0;
+    if (l < 0) {
+        buf[len++] = '-';
+    }
+    while (n > 0) {
+        buf[len++] = tmp[--n];
+    }
+    return len;
+}
+
 void
 append_to_buffer_realloc_if_necessary(char **buf, long *bufpos, long *bufs, char *str, long len)
 {
@@ -106,24 +131,34 @@ copy_string(const char *str)
     return res;
 }
 
-/* Doesn't check for collisions because who cares. */
+/*
+ * Names a file by its content: the first 16 bytes of the digest in hex, in a
+ * subdirectory named after the first byte, e.g. "ab/ab12...ef.png". Identical
+ * files get the same name.
+ */
 void
-gen_filename(char *buf, const int maxlen, const char *ext, const int extlen)
+gen_filename(char *buf, const int maxlen, const unsigned char *digest, const char *ext, const int extlen)
 {
-    const int hashlen = 20;
+    static const char hex[] = "0123456789abcdef";
+    const int hashlen = 32;
+    const int dirlen = 3;
 
-    if (maxlen < hashlen + extlen + 1) {
+    if (maxlen < dirlen + hashlen + extlen + 1) {
         fprintf(stderr, "gen_filename: Buffer too small.\n");
         exit(1);
     }
 
-    for (int i = 0; i < hashlen; i++) {
-        buf[i] = 'A' + (rand() % ('Z' - 'A'));
+    for (int i = 0; i < hashlen / 2; i++) {
+        buf[dirlen + i * 2] = hex[digest[i] >> 4];
+        buf[dirlen + i * 2 + 1] = hex[digest[i] & 0xf];
     }
+    buf[0] = buf[dirlen];
+    buf[1] = buf[dirlen + 1];
+    buf[2] = '/';
     for (int i = 0; i < extlen; i++) {
-        buf[hashlen + i] = ext[i];
+        buf[dirlen + hashlen + i] = ext[i];
     }
-    buf[hashlen + extlen] = '\0';
+    buf[dirlen + hashlen + extlen] = '\0';
 }
 
 void
@@ -157,6 +192,17 @@ save_file(const char *buf, const long bufs, const char *filename, const char *di
     fclose(fp);
 }
 
+long
+get_monotonic_ms(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        fprintf(stderr, "get_monotonic_ms: clock_gettime() failed.\n");
+        exit(1);
+    }
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void
 start_timer(void)
 {